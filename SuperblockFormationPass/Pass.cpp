@@ -1,15 +1,34 @@
 #include "llvm/IR/PassManager.h"
+#include "llvm/Pass.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/Threading.h"
 
+#include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/PostDominators.h"
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/CFG.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
@@ -23,821 +42,3399 @@
 #include "llvm/Analysis/Trace.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringMap.h"
 
 #include <iostream>
+#include <numeric>
 
 using namespace llvm;
 using namespace std;
 
+#define DEBUG_TYPE "superblock"
 
+STATISTIC(NumPointerHits, "Branches the pointer heuristic predicted");
+STATISTIC(NumLoopHits, "Branches the loop heuristic predicted");
+STATISTIC(NumOpcodeHits, "Branches the opcode heuristic predicted");
+STATISTIC(NumGuardHits, "Branches the guard heuristic predicted");
+STATISTIC(NumDirectionHits, "Branches the direction heuristic predicted");
+STATISTIC(NumCallHits, "Branches the call heuristic predicted");
+STATISTIC(NumReturnHits, "Branches the return heuristic predicted");
+STATISTIC(NumStoreHits, "Branches the store heuristic predicted");
+STATISTIC(NumLoopExitHits, "Branches the loop exit heuristic predicted");
+STATISTIC(NumLoopHeaderHits, "Branches the loop header heuristic predicted");
+STATISTIC(NumTraces, "Traces formed");
+STATISTIC(NumTraceBlocks, "Blocks in traces (over traces formed, the average trace length)");
+STATISTIC(MaxTraceLength, "Blocks in the longest trace");
+STATISTIC(NumDuplicatedTails, "Trace tails duplicated");
+STATISTIC(NumDuplicatedBlocks, "Blocks added by tail duplication");
+STATISTIC(NumDuplicatedInsts, "Instructions added by tail duplication");
+STATISTIC(NumRejectedTails, "Trace tails the cost model rejected");
+STATISTIC(NumBranchWeights, "Branches given static branch_weights");
+STATISTIC(NumFlippedBranches, "Branches inverted to fall through along a trace");
+STATISTIC(NumUnrolledLoops, "Superblock loops unrolled");
+STATISTIC(NumPeeledLoops, "Superblock loops with their first iterations peeled");
+STATISTIC(NumExpandedTargets, "Superblocks that absorbed a copy of the superblock they branch to");
+STATISTIC(NumEnlargedInsts, "Instructions added by superblock enlargement");
+STATISTIC(NumEliminatedLoads, "Loads along superblocks replaced by a value already in a register");
+STATISTIC(NumEliminatedStores, "Redundant or dead stores along superblocks removed");
+STATISTIC(NumEliminatedExprs, "Common subexpressions along superblocks removed");
+STATISTIC(NumPropagatedCopies, "Single-entry phis along superblocks replaced by their value");
+STATISTIC(NumSpeculatedInsts, "Instructions hoisted above side exits");
+STATISTIC(NumSunkInsts, "Instructions sunk out of superblocks into the exits that use them");
+STATISTIC(NumCompensationBlocks, "Exit edges split to hold sunk instructions");
+STATISTIC(NumScheduledWindows, "Superblock windows the scheduler reordered");
+STATISTIC(NumScheduleSpeculated, "Instructions the scheduler moved up past a side exit");
+STATISTIC(NumScheduleCyclesSaved, "Estimated cycles the superblock scheduler saved");
+STATISTIC(NumOutlinedRegions, "Cold regions outlined");
+
+enum class TraceMode { Static, Profile };
+
+enum class SeedOrder { Hottest, Loops };
+
+// the static heuristics, numbered by their bit in a prediction's heuristic mask
+enum Heuristic : int {
+    HeurPointer = 1, HeurLoop, HeurOpcode, HeurGuard, HeurDirection,
+    HeurCall, HeurReturn, HeurStore, HeurLoopExit, HeurLoopHeader
+};
+
+static cl::opt<TraceMode> SuperblockMode("superblock-mode", cl::init(TraceMode::Static),
+    cl::desc("How traces choose the successor to grow into"),
+    cl::values(clEnumValN(TraceMode::Static, "static", "Follow the static branch heuristics"),
+               clEnumValN(TraceMode::Profile, "profile", "Follow profile data (mutual most likely), heuristics where there is none")));
+
+static cl::opt<SeedOrder> SuperblockSeeds("superblock-seeds", cl::init(SeedOrder::Hottest),
+    cl::desc("Which unvisited block the next trace starts from"),
+    cl::values(clEnumValN(SeedOrder::Hottest, "hottest", "The most frequent block, growing backward as well as forward"),
+               clEnumValN(SeedOrder::Loops, "loops", "Innermost loop bodies first, then the rest in reverse post-order, growing forward only")));
+
+static cl::opt<double> SuperblockMinProb("superblock-min-prob", cl::init(0.6),
+    cl::desc("Minimum edge probability a profile-driven trace grows along"));
+
+static cl::opt<double> SuperblockMinConfidence("superblock-min-confidence", cl::init(0.55),
+    cl::desc("Traces stop at branches the static heuristics predict with less confidence than this"));
+
+static cl::bits<Heuristic> SuperblockDisabledHeuristics("superblock-disable-heuristic", cl::CommaSeparated,
+    cl::desc("Static heuristics not to apply (comma separated)"),
+    cl::values(clEnumValN(HeurPointer, "pointer", "Pointer comparisons"),
+               clEnumValN(HeurLoop, "loop", "Loop branches: back edges and loop header tests"),
+               clEnumValN(HeurOpcode, "opcode", "Comparisons against zero and floating point equality"),
+               clEnumValN(HeurGuard, "guard", "Successors that use an operand of the branch's compare"),
+               clEnumValN(HeurDirection, "direction", "Branches towards a loop latch"),
+               clEnumValN(HeurCall, "call", "Successors that make a call"),
+               clEnumValN(HeurReturn, "return", "Successors that return"),
+               clEnumValN(HeurStore, "store", "Successors that store"),
+               clEnumValN(HeurLoopExit, "loop-exit", "Edges that leave a loop"),
+               clEnumValN(HeurLoopHeader, "loop-header", "Successors that are a loop header or preheader")));
+
+static cl::opt<bool> SuperblockTripCounts("superblock-trip-counts", cl::init(true),
+    cl::desc("Predict loop branches from ScalarEvolution's exact or maximum trip counts where it finds one"));
+
+static cl::opt<unsigned> SuperblockTripCountMaxBlocks("superblock-trip-count-max-blocks", cl::init(5000),
+    cl::desc("Largest function, in blocks, whose trip counts are computed (SCEV's loop guard search grows "
+             "with the dominator tree depth, so larger functions cost more than they gain)"));
+
+static cl::opt<bool> SuperblockEmitBranchWeights("superblock-emit-branch-weights", cl::init(false),
+    cl::desc("Write the static predictions back as branch_weights metadata on branches without profile data"));
+
+static cl::opt<bool> SuperblockLayout("superblock-layout", cl::init(true),
+    cl::desc("Reorder blocks so every trace is contiguous and falls through along its likely path"));
+
+static cl::opt<bool> SuperblockSplitCold("superblock-split-cold", cl::init(false),
+    cl::desc("Outline cold blocks outside the hot traces into .text.unlikely functions (superblock_module only)"));
+
+static cl::opt<double> SuperblockColdFreq("superblock-cold-freq", cl::init(0.02),
+    cl::desc("Blocks below this fraction of the hottest block's frequency are cold"));
+
+static cl::opt<unsigned> SuperblockDupThreshold("superblock-dup-threshold", cl::init(100),
+    cl::desc("Largest tail, in instructions, duplicated for a side entrance the trace always reaches; "
+             "scaled by the probability of reaching it"));
+
+static cl::opt<unsigned> SuperblockDupFunctionGrowth("superblock-dup-function-growth", cl::init(50),
+    cl::desc("Percent by which tail duplication may grow a function"));
+
+static cl::opt<unsigned> SuperblockDupModuleBudget("superblock-dup-module-budget", cl::init(0),
+    cl::desc("Instructions tail duplication may add to the whole module (0 = unlimited)"));
+
+static cl::opt<bool> SuperblockEnlarge("superblock-enlarge", cl::init(false),
+    cl::desc("After tail duplication, unroll superblock loops, peel low-trip-count ones and expand short superblocks "
+             "into the superblock they branch to"));
+
+static cl::opt<unsigned> SuperblockEnlargeMaxSize("superblock-enlarge-max-size", cl::init(128),
+    cl::desc("Largest superblock, in instructions, that enlargement may produce"));
+
+static cl::opt<unsigned> SuperblockEnlargeFunctionGrowth("superblock-enlarge-function-growth", cl::init(100),
+    cl::desc("Percent by which superblock enlargement may grow a function (the module budget is shared with tail duplication)"));
+
+static cl::opt<unsigned> SuperblockUnrollFactor("superblock-unroll-factor", cl::init(4),
+    cl::desc("Most copies of its body a superblock loop is unrolled to"));
+
+static cl::opt<unsigned> SuperblockPeelMaxTrips("superblock-peel-max-trips", cl::init(4),
+    cl::desc("Superblock loops that run at most this many iterations are peeled instead of unrolled"));
+
+static cl::opt<unsigned> SuperblockExpandMaxSize("superblock-expand-max-size", cl::init(32),
+    cl::desc("Superblocks shorter than this, in instructions, absorb a copy of the superblock they most likely branch to"));
+
+static cl::opt<bool> SuperblockOptimize("superblock-optimize", cl::init(false),
+    cl::desc("Eliminate redundant loads and stores and common subexpressions, and propagate copies, along each superblock"));
+
+static cl::opt<bool> SuperblockSpeculate("superblock-speculate", cl::init(false),
+    cl::desc("Hoist instructions that are safe to speculate above side exits, and sink values only used off the "
+             "superblock into its exits"));
+
+static cl::opt<unsigned> SuperblockSpeculateMaxPressure("superblock-speculate-max-pressure", cl::init(12),
+    cl::desc("Values a superblock may keep live across a block before hoisting stops adding to them"));
+
+static cl::opt<unsigned> SuperblockSpeculateDepth("superblock-speculate-depth", cl::init(4),
+    cl::desc("Most blocks of a superblock an instruction is hoisted up across"));
+
+static cl::opt<bool> SuperblockSchedule("superblock-schedule", cl::init(false),
+    cl::desc("Reorder the instructions of each superblock by a latency-driven list schedule"));
+
+static cl::opt<unsigned> SuperblockScheduleWidth("superblock-schedule-width", cl::init(4),
+    cl::desc("Instructions the scheduler's machine model issues per cycle"));
+
+static cl::opt<unsigned> SuperblockScheduleWindow("superblock-schedule-window", cl::init(256),
+    cl::desc("Most instructions scheduled together; longer superblocks are scheduled a run of blocks at a time"));
+
+static cl::opt<unsigned> SuperblockVerbose("superblock-verbose", cl::init(0),
+    cl::desc("What superblock formation logs to stderr: 0 nothing, 1 a summary per function, 2 every decision"));
+
+static cl::opt<bool> SuperblockTimePhases("superblock-time-phases", cl::init(false),
+    cl::desc("Report the time spent in each phase of superblock formation on exit (also enabled by -time-passes)"));
+
+static cl::opt<bool> SuperblockTimePerFunction("superblock-time-per-function", cl::init(false),
+    cl::desc("Report the time spent in each phase of superblock formation for every function"));
+
+static cl::opt<std::string> SuperblockAccuracyReport("superblock-accuracy-report", cl::init(""), cl::value_desc("file"),
+    cl::desc("Write the coverage and accuracy of each heuristic, per function and per module, as JSON to this file on exit"));
+
+static cl::opt<unsigned> SuperblockThreads("superblock-threads", cl::init(0),
+    cl::desc("Number of threads superblock_module forms traces on (0 = one per core)"));
+
+
+namespace {
+
+// diagnostics go to errs(), unless the calling thread redirected them into a buffer
+thread_local raw_ostream *LogStream = nullptr;
+
+raw_ostream &logs() {
+    return LogStream ? *LogStream : errs();
+}
+
+enum LogLevel : unsigned { LogSummary = 1, LogDetail = 2 };
+
+// ------------------------------------------------- phase timing -------------------------------------------------------
+// Time spent in each phase, collected per function so that concurrent workers never share a
+// timer. The calling thread points PhaseTimes at the records of the function it works on.
+thread_local StringMap<TimeRecord> *PhaseTimes = nullptr;
+
+bool timingPhases() {
+    return SuperblockTimePhases || SuperblockTimePerFunction || TimePassesIsEnabled;
+}
+
+// Times the phases of one function into PhaseTimes and marks them in -time-trace flame charts,
+// with the function name as detail. Entering a phase ends the one before it.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(StringRef function) : function(function) {}
+    ~PhaseTimer() { stop(); }
+
+    void enter(StringRef name) {
+        stop();
+        phase = name;
+        running = true;
+        if (PhaseTimes) {
+            start = TimeRecord::getCurrentTime(true);
+        }
+        if (timeTraceProfilerEnabled()) {
+            timeTraceProfilerBegin(name, function);
+        }
+    }
+
+    void stop() {
+        if (!running) {
+            return;
+        }
+        running = false;
+        if (timeTraceProfilerEnabled()) {
+            timeTraceProfilerEnd();
+        }
+        if (PhaseTimes) {
+            TimeRecord elapsed = TimeRecord::getCurrentTime(false);
+            elapsed -= start;
+            (*PhaseTimes)[phase] += elapsed;
+        }
+    }
+
+private:
+    StringRef function;
+    StringRef phase;
+    bool running = false;
+    TimeRecord start;
+};
+
+// the phase times of every function, printed like -time-passes when LLVM shuts down
+struct PhaseReport {
+    StringMap<TimeRecord> totals;
+
+    ~PhaseReport() {
+        if (!totals.empty()) {
+            TimerGroup("superblock", "Superblock formation phases", totals).print(errs());
+        }
+    }
+};
+ManagedStatic<PhaseReport> PhaseTotals;
+
+// adds one function's phase times to the totals, and prints them with -superblock-time-per-function
+void reportPhaseTimes(const StringMap<TimeRecord> &times, StringRef function) {
+    if (times.empty()) {
+        return;
+    }
+    for (auto &entry : times) {
+        PhaseTotals->totals[entry.getKey()] += entry.getValue();
+    }
+    if (SuperblockTimePerFunction) {
+        TimerGroup("superblock", ("Superblock formation phases for " + function).str(), times).print(errs());
+    }
+}
+
+// writes the stream expression X to logs() if -superblock-verbose is at least level, and
+// otherwise does not evaluate it
+#define SB_LOG(level, X) do { if (SuperblockVerbose >= (level)) { logs() << X; } } while (false)
+
+// opcode of the instruction a prediction was derived from
+enum class BranchOpcode : uint8_t { Br, ICmp, FCmp };
+
+// Probability that the branch predicted by each heuristic goes the predicted way, the
+// measured hit rates from Ball and Larus as used by Wu and Larus.
+double heuristicHitRate(int heur) {
+    switch (heur) {
+        case HeurPointer: return 0.60;
+        case HeurLoop: return 0.88;
+        case HeurOpcode: return 0.84;
+        case HeurGuard: return 0.62;
+        case HeurDirection: return 0.80;
+        case HeurCall: return 0.78;
+        case HeurReturn: return 0.72;
+        case HeurStore: return 0.55;
+        case HeurLoopExit: return 0.80;
+        case HeurLoopHeader: return 0.75;
+    }
+    return 0.5;
+}
+
+constexpr int NumHeuristics = HeurLoopHeader;
+
+const char *heuristicName(int heur) {
+    switch (heur) {
+        case HeurPointer: return "pointer";
+        case HeurLoop: return "loop";
+        case HeurOpcode: return "opcode";
+        case HeurGuard: return "guard";
+        case HeurDirection: return "direction";
+        case HeurCall: return "call";
+        case HeurReturn: return "return";
+        case HeurStore: return "store";
+        case HeurLoopExit: return "loop-exit";
+        case HeurLoopHeader: return "loop-header";
+    }
+    return "unknown";
+}
+
+bool heuristicEnabled(Heuristic heur) {
+    return !SuperblockDisabledHeuristics.isSet(heur);
+}
+
+// Dempster-Shafer combination of two independent probabilities of the same event
+double combineProbability(double p, double q) {
+    double taken = p * q;
+    double not_taken = (1 - p) * (1 - q);
+    if (taken + not_taken == 0) {
+        return 0.5;
+    }
+    return taken / (taken + not_taken);
+}
+
+// the static prediction for the conditional branch terminating bb
 struct RelBranch {
     BasicBlock *bb;
-    string opcode;
+    std::pair<llvm::Value*, llvm::Value*> operandPair;
     llvm::CmpInst::Predicate pr;
-    std::list<std::pair<llvm::Value* , llvm::Value* >> operandPair;
-    int heuristic;
-    bool dir;
+    unsigned group;
+    BranchOpcode opcode;
+    uint16_t heuristics;  // bit i is set if heuristic i applied to bb itself
+    uint16_t votes;       // bit i is set if heuristic i predicted successor 0 of bb itself
+    double probTaken;     // probability of successor 0 from the heuristics that applied to bb only
 };
 
-std::vector<RelBranch> relbranch;
+// Function-scoped table of static predictions, indexed by block. Every heuristic that applies
+// to a branch contributes its hit rate as evidence, combined Wu-Larus style into a probability
+// for successor 0. Branches comparing the same operand pair share a group, so evidence found
+// on one of them predicts all of them; each heuristic counts once per group and once per block.
+class BranchPredictionTable {
+public:
+    static constexpr unsigned NoGroup = ~0u;
 
-namespace {
+    // adds evidence that is shared with every branch comparing the same operands
+    void relate(BasicBlock *BB, BranchOpcode opc, llvm::CmpInst::Predicate pred, Value *op0, Value *op1, int heur, bool path) {
+        if (!op0 && !op1) {
+            record(BB, opc, pred, op0, op1, heur, path);
+            return;
+        }
+        auto inserted = groupIndex.try_emplace(std::make_pair(op0, op1), groups.size());
+        unsigned g = inserted.first->second;
+        if (inserted.second) {
+            groups.push_back({pred, 0, 0, 0.5});
+        }
+        Group &group = groups[g];
+        if (!(group.heuristics & (1u << heur))) {
+            // the group's probability is relative to the predicate it was created with
+            bool group_path = pred != group.pr ? !path : path;
+            double taken = group_path ? heuristicHitRate(heur) : 1 - heuristicHitRate(heur);
+            group.probTaken = combineProbability(group.probTaken, taken);
+            group.heuristics |= 1u << heur;
+            if (group_path) {
+                group.votes |= 1u << heur;
+            }
+        }
+        RelBranch &branch = get(BB, opc, pred, op0, op1);
+        if (branch.group == NoGroup) {
+            branch.group = g;
+            branch.operandPair = std::make_pair(op0, op1);
+            branch.pr = pred;
+            branch.opcode = opc;
+        }
+    }
+
+    // adds evidence about BB's branch that is not related to any other branch
+    void record(BasicBlock *BB, BranchOpcode opc, llvm::CmpInst::Predicate pred, Value *op0, Value *op1, int heur, bool path) {
+        record(BB, opc, pred, op0, op1, heur, path, heuristicHitRate(heur));
+    }
+
+    // as above, with the probability that path is taken known for this branch instead of
+    // the heuristic's hit rate
+    void record(BasicBlock *BB, BranchOpcode opc, llvm::CmpInst::Predicate pred, Value *op0, Value *op1, int heur, bool path,
+                double rate) {
+        RelBranch &branch = get(BB, opc, pred, op0, op1);
+        if (!(branch.heuristics & (1u << heur))) {
+            double taken = path ? rate : 1 - rate;
+            branch.probTaken = combineProbability(branch.probTaken, taken);
+            branch.heuristics |= 1u << heur;
+            if (path) {
+                branch.votes |= 1u << heur;
+            }
+        }
+    }
+
+    // the prediction for BB, or nullptr if no heuristic applied to it
+    const RelBranch *lookup(const BasicBlock *BB) const {
+        auto it = blockIndex.find(BB);
+        if (it == blockIndex.end()) {
+            return nullptr;
+        }
+        return &records[it->second];
+    }
+
+    // combined probability that the branch goes to successor 0
+    double probability(const RelBranch &branch) const {
+        if (branch.group == NoGroup) {
+            return branch.probTaken;
+        }
+        const Group &g = groups[branch.group];
+        double shared = branch.pr == g.pr ? g.probTaken : 1 - g.probTaken;
+        return combineProbability(branch.probTaken, shared);
+    }
+
+    // true if successor 0 is the likely path
+    bool direction(const RelBranch &branch) const {
+        return probability(branch) >= 0.5;
+    }
+
+    // how strongly the likely path is predicted, between 0.5 and 1
+    double confidence(const RelBranch &branch) const {
+        double p = probability(branch);
+        return p > 0.5 ? p : 1 - p;
+    }
+
+    // every heuristic that contributed to the prediction, as a bit mask
+    unsigned heuristics(const RelBranch &branch) const {
+        if (branch.group == NoGroup) {
+            return branch.heuristics;
+        }
+        return branch.heuristics | groups[branch.group].heuristics;
+    }
+
+    // true if heuristic heur, one of heuristics(branch), predicted successor 0; evidence on
+    // the block itself wins over evidence shared with its group
+    bool predictsTaken(const RelBranch &branch, int heur) const {
+        unsigned bit = 1u << heur;
+        if ((branch.heuristics & bit) || branch.group == NoGroup) {
+            return branch.votes & bit;
+        }
+        const Group &g = groups[branch.group];
+        bool taken = g.votes & bit;
+        return branch.pr == g.pr ? taken : !taken;
+    }
+
+    // the trip count the loop heuristic used for the loop headed by header, or 0 if it had none
+    void recordTripCount(const BasicBlock *header, unsigned trips) { tripCounts[header] = trips; }
+    unsigned tripCount(const BasicBlock *header) const { return tripCounts.lookup(header); }
+
+    size_t size() const { return records.size(); }
+    bool empty() const { return records.empty(); }
+
+    void clear() {
+        records.clear();
+        groups.clear();
+        blockIndex.clear();
+        groupIndex.clear();
+        tripCounts.clear();
+    }
+
+private:
+    struct Group {
+        llvm::CmpInst::Predicate pr;
+        uint16_t heuristics;
+        uint16_t votes;
+        double probTaken;
+    };
+
+    RelBranch &get(BasicBlock *BB, BranchOpcode opc, llvm::CmpInst::Predicate pred, Value *op0, Value *op1) {
+        auto inserted = blockIndex.try_emplace(BB, records.size());
+        if (inserted.second) {
+            records.push_back({BB, std::make_pair(op0, op1), pred, NoGroup, opc, 0, 0, 0.5});
+        }
+        return records[inserted.first->second];
+    }
+
+    std::vector<RelBranch> records;
+    std::vector<Group> groups;
+    DenseMap<const BasicBlock*, unsigned> blockIndex;
+    DenseMap<std::pair<Value*, Value*>, unsigned> groupIndex;
+    DenseMap<const BasicBlock*, unsigned> tripCounts;
+};
+
+//returns true if the predicate is SLT
+bool isSLT(CmpInst *cmpInst) {
+    if (cmpInst->getPredicate() == CmpInst::ICMP_SLT) {
+        return true;
+    }
+    return false;
+}
+
+
+// ----------------------------------------------- block summaries ------------------------------------------------------
+// What the heuristics need to know about a block, classified in one walk over the function
+// so that no heuristic has to walk the block's instructions again
+struct BlockSummary {
+    BasicBlock *bb;
+    BranchInst *branch;                      // bb's terminator if it is a branch
+    CmpInst *condition;                      // the compare branch tests if it is conditional, wherever it is
+    SmallVector<StoreInst*, 2> stores;
+    bool calls;                              // bb calls a function, not counting intrinsics
+    bool returns;                            // bb ends in a return
+};
 
-void relatedBranchesHeuristic(BasicBlock* BB, string opc, llvm::CmpInst::Predicate pred, std::list<std::pair<Value* , Value* >> oppair, int heur, bool path) {
-    for (auto& branch : relbranch) {
-        if (oppair == branch.operandPair) {
-            if (heur > branch.heuristic) {
-                // change the direction of the new branch according to the higher priority heuristic
-                if (pred == branch.pr) {
-                    relbranch.push_back({BB, opc, pred, oppair, branch.heuristic, branch.dir});
-                } 
+struct FunctionSummary {
+    using Edge = std::pair<const BasicBlock*, const BasicBlock*>;
+    std::vector<BlockSummary> blocks;
+    DenseMap<const BasicBlock*, unsigned> index;
+    // where the operands of the branch conditions are used: by block, and for a phi by the edge
+    // it takes the operand along
+    DenseSet<std::pair<const BasicBlock*, const Value*>> operandUses;
+    DenseSet<std::pair<Edge, const Value*>> operandPhiUses;
+
+    const BlockSummary *lookup(const BasicBlock *BB) const {
+        auto it = index.find(BB);
+        return it == index.end() ? nullptr : &blocks[it->second];
+    }
+
+    // true if BB uses V, an operand of a branch condition, on the way in from pred
+    bool usesOperand(const BasicBlock *BB, const Value *V, const BasicBlock *pred) const {
+        return operandUses.count({BB, V}) || operandPhiUses.count({{pred, BB}, V});
+    }
+};
+
+FunctionSummary summarizeFunction(Function &F) {
+    FunctionSummary summary;
+    summary.blocks.reserve(F.size());
+    for (BasicBlock &BB : F) {
+        summary.index[&BB] = summary.blocks.size();
+        BranchInst *branch = dyn_cast<BranchInst>(BB.getTerminator());
+        CmpInst *condition = branch && branch->isConditional() ? dyn_cast<CmpInst>(branch->getCondition()) : nullptr;
+        summary.blocks.push_back({&BB, branch, condition, {}, false, isa<ReturnInst>(BB.getTerminator())});
+        BlockSummary &block = summary.blocks.back();
+        for (Instruction &I : BB) {
+            if (StoreInst *store = dyn_cast<StoreInst>(&I)) {
+                block.stores.push_back(store);
+            }
+            else if (isa<CallBase>(&I) && !isa<IntrinsicInst>(&I)) {
+                block.calls = true;
+            }
+        }
+    }
+    // each operand's use list is walked once, however many conditions compare it
+    SmallPtrSet<Value*, 16> operands;
+    for (const BlockSummary &block : summary.blocks) {
+        if (!block.condition) {
+            continue;
+        }
+        for (Value *op : block.condition->operand_values()) {
+            if ((!isa<Instruction>(op) && !isa<Argument>(op)) || !operands.insert(op).second) {
+                continue;
+            }
+            for (Use &U : op->uses()) {
+                Instruction *user = dyn_cast<Instruction>(U.getUser());
+                if (!user) {
+                    continue;
+                }
+                if (PHINode *phi = dyn_cast<PHINode>(user)) {
+                    summary.operandPhiUses.insert({{phi->getIncomingBlock(U), phi->getParent()}, op});
+                }
                 else {
-                    relbranch.push_back({BB, opc, pred, oppair, branch.heuristic, !branch.dir});
+                    summary.operandUses.insert({user->getParent(), op});
                 }
-                break;
+            }
+        }
+    }
+    return summary;
+}
+
+// -------------------------------------------------- loop summary -----------------------------------------------------
+// The loop structure the heuristics ask about, collected once per function from the loops at
+// every depth, so each question is a set lookup instead of a walk over the loop nest. With
+// ScalarEvolution it also holds the trip count of each loop it can bound, by header. SCEV is
+// not thread-safe, so the summary must be built on the thread that owns the analyses.
+class LoopSummary {
+public:
+    explicit LoopSummary(LoopInfo &li, ScalarEvolution *se = nullptr) {
+        if (se) {
+            for (Loop *top : li) {
+                countTrips(*top, *se);
+            }
+        }
+        for (Loop *L : li.getLoopsInPreorder()) {
+            BasicBlock *header = L->getHeader();
+            headers.insert(header);
+            if (BasicBlock *preheader = L->getLoopPreheader()) {
+                preheaders.insert(preheader);
+            }
+            SmallVector<BasicBlock*, 4> loop_latches;
+            L->getLoopLatches(loop_latches);
+            for (BasicBlock *latch : loop_latches) {
+                latches.insert(latch);
+                backEdges.insert({latch, header});
+            }
+            SmallVector<Loop::Edge, 4> loop_exits;
+            L->getExitEdges(loop_exits);
+            for (const Loop::Edge &exit : loop_exits) {
+                exitEdges.insert(exit);
+                exitingBlocks.insert(exit.first);
+            }
+        }
+    }
+
+    bool isHeader(const BasicBlock *BB) const { return headers.count(BB); }
+    bool isPreheader(const BasicBlock *BB) const { return preheaders.count(BB); }
+    bool isLatch(const BasicBlock *BB) const { return latches.count(BB); }
+    bool isExiting(const BasicBlock *BB) const { return exitingBlocks.count(BB); }
+    bool isBackEdge(const BasicBlock *from, const BasicBlock *to) const { return backEdges.count({from, to}); }
+    // true if from -> to leaves some loop containing from
+    bool isExitEdge(const BasicBlock *from, const BasicBlock *to) const { return exitEdges.count({from, to}); }
+
+    // times the loop headed by header runs its body per entry, or 0 if SCEV cannot bound it
+    unsigned tripCount(const BasicBlock *header) const { return tripCounts.lookup(header); }
+
+private:
+    // the exact trip count of each loop of the nest, or else its maximum, level by level
+    void countTrips(Loop &top, ScalarEvolution &se) {
+        std::unique_ptr<LoopNest> nest = LoopNest::getLoopNest(top, se);
+        unsigned outer = top.getLoopDepth();
+        for (unsigned depth = outer; depth < outer + nest->getNestDepth(); depth++) {
+            for (Loop *L : nest->getLoopsAtDepth(depth)) {
+                unsigned trips = se.getSmallConstantTripCount(L);
+                const char *kind = "exact";
+                if (!trips) {
+                    trips = se.getSmallConstantMaxTripCount(L);
+                    kind = "maximum";
+                }
+                if (trips) {
+                    tripCounts[L->getHeader()] = trips;
+                    SB_LOG(LogDetail, "loop " << L->getHeader()->getName() << " at depth " << depth << ": "
+                           << kind << " trip count " << trips << "\n");
+                }
+            }
+        }
+    }
+
+
+    using Edge = std::pair<const BasicBlock*, const BasicBlock*>;
+    SmallPtrSet<const BasicBlock*, 8> headers;
+    SmallPtrSet<const BasicBlock*, 8> preheaders;
+    SmallPtrSet<const BasicBlock*, 8> latches;
+    SmallPtrSet<const BasicBlock*, 8> exitingBlocks;
+    DenseSet<Edge> backEdges;
+    DenseSet<Edge> exitEdges;
+    DenseMap<const BasicBlock*, unsigned> tripCounts;
+};
+
+//Returns true if the constant variable for comparison is 0
+bool isZero(Instruction &I, Value &v) {
+        if (auto constInt = dyn_cast<ConstantInt>(&v)) {
+            if (constInt->isZero()) {
+                return true;
+            }
+        }
+    return false;
+}
+bool isFloatingPt(Instruction &I) {
+    if (FCmpInst *FCC = dyn_cast<FCmpInst>(&I)) {
+        if (FCC->getPredicate() == CmpInst::FCMP_OEQ) {
+            Value &op0 = *I.getOperand(0);
+            Value &op1 = *I.getOperand(1);
+            if (isa<ConstantFP>(&op0) && !(isa<ConstantFP>(&op1))) {
+                return true;
+            }
+            else if (!(isa<ConstantFP>(&op0)) && isa<ConstantFP>(&op1)){
+                return true;
+            }
+        } 
+    }
+    return false;
+}
+//Returns true if the integer compare is a comparison against zero that is unlikely to hold
+//(x > 0 with x == 0 on the left, x < 0), so its branch is not taken
+bool isNegativeComparison (ICmpInst &I) {
+    llvm::CmpInst::Predicate pr=I.getSignedPredicate();
+    Value &SLT = *I.getOperand(1);
+    Value &SGT = *I.getOperand(0);
+    switch(pr){
+        case CmpInst::ICMP_SGT: return isZero(I, SGT);
+        case CmpInst::ICMP_SLT: return isZero(I, SLT);
+        default: return false;
+    }
+}
+
+
+// returns true if the compare the block's branch tests predicted it
+bool opcodeHeuristic(const BlockSummary &summary, BranchPredictionTable &table) {
+    if (ICmpInst *ICC = dyn_cast_or_null<ICmpInst>(summary.condition)) {
+        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
+        llvm::Value* passop1 = ICC->getOperand(0);
+        llvm::Value* passop2 = ICC->getOperand(1);
+        if (isNegativeComparison(*ICC)) {
+            SB_LOG(LogDetail, "I Not taken" << *ICC << "\n");
+            table.relate(summary.bb, BranchOpcode::ICmp, pr, passop1, passop2, HeurOpcode, false);
+        }
+        else {
+            table.relate(summary.bb, BranchOpcode::ICmp, pr, passop1, passop2, HeurOpcode, true);
+        }
+        return true;
+    }
+    if (FCmpInst *FCC = dyn_cast_or_null<FCmpInst>(summary.condition)) {
+        llvm::CmpInst::Predicate pr=FCC->getPredicate();
+        llvm::Value* passop1 = FCC->getOperand(0);
+        llvm::Value* passop2 = FCC->getOperand(1);
+        if (isFloatingPt(*FCC)) {
+            SB_LOG(LogDetail, "I Not taken" << *FCC << "\n");
+            table.relate(summary.bb, BranchOpcode::FCmp, pr, passop1, passop2, HeurOpcode, false);
+        }
+        else {
+            table.relate(summary.bb, BranchOpcode::FCmp, pr, passop1, passop2, HeurOpcode, true);
+        }
+        return true;
+    }
+    return false;
+}
+
+// a branch whose successor is the latch of a loop, i.e. that heads back towards the loop's header, is taken;
+// it says nothing if both successors are latches, or if the latch is reached by leaving a loop
+bool branchDirectionHeuristic(const BlockSummary &summary, const LoopSummary &loops, BranchPredictionTable &table) {
+    if (!summary.branch || !summary.branch->isConditional()) {
+        return false;
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        BasicBlock *Succ = summary.branch->getSuccessor(i);
+        BasicBlock *Other = summary.branch->getSuccessor(1 - i);
+        if (loops.isLatch(Succ) && !loops.isLatch(Other) && !loops.isExitEdge(summary.bb, Succ)) {
+            llvm::CmpInst::Predicate pr = CmpInst::BAD_ICMP_PREDICATE;
+            Value* passop1 = NULL;
+            Value* passop2 = NULL;
+            table.relate(summary.bb, BranchOpcode::Br, pr, passop1, passop2, HeurDirection, i == 0);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isPointerEqual (ICmpInst &I) {
+    llvm::CmpInst::Predicate pr=I.getSignedPredicate();
+    SB_LOG(LogDetail, "in pointer equal " << pr << "\n");
+    switch(pr){
+        case CmpInst::ICMP_EQ: return true;
+        case CmpInst::ICMP_NE: return false;
+        default: return false;
+    }
+}
+
+// a load through a getelementptr, i.e. a pointer or field read from memory
+bool isLoadOfGEP(Value *V) {
+    LoadInst *load = dyn_cast<LoadInst>(V);
+    return load && isa<GetElementPtrInst>(load->getPointerOperand());
+}
+
+// judges the pointer compare the block's branch tests
+int pointerHeuristic(const BlockSummary &summary, BranchPredictionTable &table) {
+    ICmpInst *ICC = dyn_cast_or_null<ICmpInst>(summary.condition);
+    if (ICC && isa<LoadInst>(ICC->getOperand(0))) {
+        SB_LOG(LogDetail, "the instr is " << *ICC << "\n");
+        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
+        llvm::Value* passop1 = ICC->getOperand(0);
+        llvm::Value* passop2 = ICC->getOperand(1);
+        if (isLoadOfGEP(passop1) && isLoadOfGEP(passop2)) {
+            if (isPointerEqual(*ICC)) {
+                SB_LOG(LogDetail, "Second label is taken (corresponding to else path)" << "\n");
+                table.relate(summary.bb, BranchOpcode::ICmp, pr, passop1, passop2, HeurPointer, false);
+                return 2;
+            }
+            else {
+                SB_LOG(LogDetail, "First label is taken (corresponding to if path)" << "\n");
+                table.relate(summary.bb, BranchOpcode::ICmp, pr, passop1, passop2, HeurPointer, true);
+                return 1;
+            }
+        }
+        else if (!isLoadOfGEP(passop1) && isa<ConstantPointerNull>(passop2)) {
+            // a pointer loaded from memory compared against null
+            switch(pr){
+                case CmpInst::ICMP_EQ: SB_LOG(LogDetail, "Second label is taken (corresponding to else path)" << "\n");
+                table.record(summary.bb, BranchOpcode::ICmp, pr, passop1, nullptr, HeurPointer, false);
+                return 2;
+                case CmpInst::ICMP_NE: SB_LOG(LogDetail, "First label is taken (corresponding to if path)" << "\n");
+                table.record(summary.bb, BranchOpcode::ICmp, pr, passop1, nullptr, HeurPointer, true);
+                return 1;
+                default: SB_LOG(LogDetail, "pointers have some other comparison operator" << "\n");
+                return 0;
+            }
+        }
+    }
+    SB_LOG(LogDetail, "pointer heuristics are not used\n");
+    return 0;
+}
+
+// keeps loop predictions from trip counts short of certain, so other evidence still counts
+constexpr double MinTripProbability = 0.01;
+
+// A back edge is taken, and so is the loop body when the header tests whether to leave the loop.
+// For loops with a known trip count the probability comes from the count instead of the hit rate.
+int loopHeuristic(const BlockSummary &summary, const LoopSummary &loops, BranchPredictionTable &table) {
+    if (!summary.branch || !summary.branch->isConditional()) {
+        SB_LOG(LogDetail, "loop heuristics not applied" << "\n");
+        return 0;
+    }
+    BasicBlock *BB = summary.bb;
+    for (unsigned i = 0; i < 2; i++) {
+        BasicBlock *Succ = summary.branch->getSuccessor(i);
+        BasicBlock *Other = summary.branch->getSuccessor(1 - i);
+        bool taken = loops.isBackEdge(BB, Succ)
+            || (loops.isHeader(BB) && loops.isExitEdge(BB, Other) && !loops.isExitEdge(BB, Succ));
+        if (taken) {
+            SB_LOG(LogDetail, "This block is taken " << Succ->getName() << "\n");
+            llvm::CmpInst::Predicate pr = CmpInst::BAD_ICMP_PREDICATE;
+            Value* passop1 = NULL;
+            Value* passop2 = NULL;
+            // with a trip count the loop exits once in trips tests, so a 2 iteration loop is a coin
+            // flip rather than a loop that always goes round again
+            unsigned trips = loops.tripCount(loops.isBackEdge(BB, Succ) ? Succ : BB);
+            if (trips) {
+                double stay = std::min(std::max(1.0 - 1.0 / trips, MinTripProbability), 1 - MinTripProbability);
+                table.record(BB, BranchOpcode::Br, pr, passop1, passop2, HeurLoop, i == 0, stay);
             }
             else {
-                // if new branch statement has a higher priority heuristic, then need to update all other branches with same variables
-                branch.heuristic = heur;
-                if (pred == branch.pr) {
-                    branch.dir = path;
+                table.record(BB, BranchOpcode::Br, pr, passop1, passop2, HeurLoop, i == 0);
+            }
+            return 1;
+        }
+    }
+    SB_LOG(LogDetail, "loop heuristics not applied" << "\n");
+    return 0;
+}
+
+// Predicts the successor of summary's branch for which prefers holds, if it holds for exactly one
+// of the two. Used by the heuristics that judge a branch by what its successors do.
+bool preferSuccessor(const BlockSummary &summary, Heuristic heur, BranchPredictionTable &table,
+                     function_ref<bool(BasicBlock*)> prefers) {
+    if (!summary.branch || !summary.branch->isConditional()) {
+        return false;
+    }
+    bool first = prefers(summary.branch->getSuccessor(0));
+    bool second = prefers(summary.branch->getSuccessor(1));
+    if (first == second) {
+        return false;
+    }
+    SB_LOG(LogDetail, heuristicName(heur) << " heuristic takes successor " << (first ? 0 : 1) << "\n");
+    table.record(summary.bb, BranchOpcode::Br, CmpInst::BAD_ICMP_PREDICATE, nullptr, nullptr, heur, first);
+    return true;
+}
+
+// a successor that uses an operand of the compare the branch tests, and does not post-dominate
+// the branch, is taken: the compare guards the use
+bool guardHeuristic(const BlockSummary &summary, const FunctionSummary &function_summary, const PostDominatorTree &pdt,
+                    BranchPredictionTable &table) {
+    CmpInst *cmp = summary.condition;
+    if (!cmp) {
+        return false;
+    }
+    return preferSuccessor(summary, HeurGuard, table, [&](BasicBlock *Succ) {
+        return !pdt.dominates(Succ, summary.bb) && llvm::any_of(cmp->operand_values(), [&](Value *op) {
+            return function_summary.usesOperand(Succ, op, summary.bb);
+        });
+    });
+}
+
+// a successor that calls a function and does not post-dominate the branch is not taken
+bool callHeuristic(const BlockSummary &summary, const FunctionSummary &function_summary, const PostDominatorTree &pdt,
+                   BranchPredictionTable &table) {
+    return preferSuccessor(summary, HeurCall, table, [&](BasicBlock *Succ) {
+        const BlockSummary *succ_summary = function_summary.lookup(Succ);
+        return !(succ_summary && succ_summary->calls && !pdt.dominates(Succ, summary.bb));
+    });
+}
+
+// a successor that returns, or goes straight to a block that returns, is not taken
+bool returnHeuristic(const BlockSummary &summary, const FunctionSummary &function_summary, BranchPredictionTable &table) {
+    auto returns = [&](BasicBlock *BB) {
+        const BlockSummary *block = function_summary.lookup(BB);
+        return block && block->returns;
+    };
+    return preferSuccessor(summary, HeurReturn, table, [&](BasicBlock *Succ) {
+        BasicBlock *next = Succ->getSingleSuccessor();
+        return !(returns(Succ) || (next && returns(next)));
+    });
+}
+
+// a successor that stores to memory and does not post-dominate the branch is not taken
+bool storeHeuristic(const BlockSummary &summary, const FunctionSummary &function_summary, const PostDominatorTree &pdt,
+                    BranchPredictionTable &table) {
+    return preferSuccessor(summary, HeurStore, table, [&](BasicBlock *Succ) {
+        const BlockSummary *succ_summary = function_summary.lookup(Succ);
+        return !(succ_summary && !succ_summary->stores.empty() && !pdt.dominates(Succ, summary.bb));
+    });
+}
+
+// inside a loop, away from its header and back edges, the edge leaving the loop is not taken
+bool loopExitHeuristic(const BlockSummary &summary, const LoopSummary &loops, BranchPredictionTable &table) {
+    if (!summary.branch || !summary.branch->isConditional() || !loops.isExiting(summary.bb) || loops.isHeader(summary.bb)) {
+        return false;
+    }
+    if (loops.isHeader(summary.branch->getSuccessor(0)) || loops.isHeader(summary.branch->getSuccessor(1))) {
+        return false;
+    }
+    return preferSuccessor(summary, HeurLoopExit, table, [&](BasicBlock *Succ) {
+        return !loops.isExitEdge(summary.bb, Succ);
+    });
+}
+
+// a successor that enters a loop, as its header or preheader, and does not post-dominate the branch
+// is taken; back edges are left to the loop heuristic
+bool loopHeaderHeuristic(const BlockSummary &summary, const LoopSummary &loops, const PostDominatorTree &pdt,
+                         BranchPredictionTable &table) {
+    return preferSuccessor(summary, HeurLoopHeader, table, [&](BasicBlock *Succ) {
+        return (loops.isHeader(Succ) || loops.isPreheader(Succ)) && !loops.isBackEdge(summary.bb, Succ)
+            && !pdt.dominates(Succ, summary.bb);
+    });
+}
+
+// classifies F's instructions once, then runs every enabled heuristic off the block summaries
+void runHeuristics(Function &F, llvm::LoopAnalysis::Result &li, const PostDominatorTree &pdt, ScalarEvolution *se,
+                   BranchPredictionTable &table) {
+    table.clear();
+    FunctionSummary function_summary = summarizeFunction(F);
+    LoopSummary loops(li, se);
+    for (const BlockSummary &summary : function_summary.blocks) {
+        SB_LOG(LogDetail, "in BB " << summary.bb->getName() << "\n");
+        if (heuristicEnabled(HeurPointer) && pointerHeuristic(summary, table)) {
+            ++NumPointerHits;
+        }
+        if (heuristicEnabled(HeurLoop) && loopHeuristic(summary, loops, table)) {
+            ++NumLoopHits;
+        }
+        if (heuristicEnabled(HeurOpcode) && opcodeHeuristic(summary, table)) {
+            ++NumOpcodeHits;
+        }
+        if (heuristicEnabled(HeurGuard) && guardHeuristic(summary, function_summary, pdt, table)) {
+            ++NumGuardHits;
+        }
+        if (heuristicEnabled(HeurDirection) && branchDirectionHeuristic(summary, loops, table)) {
+            ++NumDirectionHits;
+        }
+        if (heuristicEnabled(HeurCall) && callHeuristic(summary, function_summary, pdt, table)) {
+            ++NumCallHits;
+        }
+        if (heuristicEnabled(HeurReturn) && returnHeuristic(summary, function_summary, table)) {
+            ++NumReturnHits;
+        }
+        if (heuristicEnabled(HeurStore) && storeHeuristic(summary, function_summary, pdt, table)) {
+            ++NumStoreHits;
+        }
+        if (heuristicEnabled(HeurLoopExit) && loopExitHeuristic(summary, loops, table)) {
+            ++NumLoopExitHits;
+        }
+        if (heuristicEnabled(HeurLoopHeader) && loopHeaderHeuristic(summary, loops, pdt, table)) {
+            ++NumLoopHeaderHits;
+        }
+    }
+    // kept for superblock enlargement, which unrolls or peels by them
+    for (Loop *L : li.getLoopsInPreorder()) {
+        if (unsigned trips = loops.tripCount(L->getHeader())) {
+            table.recordTripCount(L->getHeader(), trips);
+        }
+    }
+    SB_LOG(LogSummary, F.getName() << ": " << table.size() << " predictions recorded\n");
+        
+}
+
+// ------------------------------------- static branch prediction analysis ----------------------------------------------
+// The heuristics' predictions for a function, cached by the function analysis manager so that
+// any pass can query them. The result refers to blocks and successor order, so a pass that
+// changes either has to drop it.
+struct StaticBranchPredictionAnalysis : public AnalysisInfoMixin<StaticBranchPredictionAnalysis> {
+    using Result = BranchPredictionTable;
+
+    Result run(Function &F, FunctionAnalysisManager &FAM) {
+        llvm::LoopAnalysis::Result &li = FAM.getResult<LoopAnalysis>(F);
+        PostDominatorTree &pdt = FAM.getResult<PostDominatorTreeAnalysis>(F);
+        ScalarEvolution *se = nullptr;
+        if (SuperblockTripCounts && F.size() <= SuperblockTripCountMaxBlocks) {
+            se = &FAM.getResult<ScalarEvolutionAnalysis>(F);
+        }
+        PhaseTimer timer(F.getName());
+        timer.enter("heuristics");
+        BranchPredictionTable table;
+        runHeuristics(F, li, pdt, se, table);
+        return table;
+    }
+
+private:
+    friend AnalysisInfoMixin<StaticBranchPredictionAnalysis>;
+    static AnalysisKey Key;
+};
+
+AnalysisKey StaticBranchPredictionAnalysis::Key;
+
+// the successor the heuristics predict for curr's conditional branch, or nullptr if none of them applied
+BasicBlock* getMostLikely(BasicBlock* curr, const BranchPredictionTable &table) {
+    BranchInst *branch_inst = dyn_cast<BranchInst>(curr->getTerminator());
+    const RelBranch *branch = table.lookup(curr);
+    if (!branch || !branch_inst || !branch_inst->isConditional()) {
+        return nullptr;
+    }
+    bool path = table.direction(*branch);
+    if (path) {
+        return branch_inst->getSuccessor(0);
+    }
+    else {
+        return branch_inst->getSuccessor(1);
+    }
+}
+
+// ----------------------------------------------- prediction accuracy --------------------------------------------------
+// How one predictor did on the branches it predicted, against BranchProbabilityInfo, which
+// follows the profile where there is one. A hit predicts the successor BPI finds more likely.
+struct AccuracyCounts {
+    unsigned fired = 0;
+    unsigned hits = 0;
+    double executions = 0;      // of the predicted branches
+    double hitExecutions = 0;
+    double mispredictions = 0;  // executions that went the other way than predicted
+    double predictedProb = 0;   // summed probability of the predicted successors
+    double bestProb = 0;        // summed probability of the more likely successors
+
+    void count(bool taken, double prob_taken, double execs) {
+        double p = taken ? prob_taken : 1 - prob_taken;
+        double best = std::max(prob_taken, 1 - prob_taken);
+        fired += 1;
+        executions += execs;
+        mispredictions += execs * (1 - p);
+        predictedProb += p;
+        bestProb += best;
+        if (p >= best) {
+            hits += 1;
+            hitExecutions += execs;
+        }
+    }
+
+    void add(const AccuracyCounts &other) {
+        fired += other.fired;
+        hits += other.hits;
+        executions += other.executions;
+        hitExecutions += other.hitExecutions;
+        mispredictions += other.mispredictions;
+        predictedProb += other.predictedProb;
+        bestProb += other.bestProb;
+    }
+};
+
+// Coverage and accuracy of the combined prediction and of each heuristic on the conditional
+// branches of a function or module. Executions are profile counts if there is a profile, and
+// otherwise BFI's estimate of executions per call of the function.
+struct PredictionAccuracy {
+    bool profiled = true;
+    unsigned branches = 0;
+    unsigned uncovered = 0;  // branches no heuristic predicted
+    double executions = 0;
+    double uncoveredExecutions = 0;
+    AccuracyCounts combined;
+    AccuracyCounts heuristic[NumHeuristics + 1];  // indexed by heuristic number
+
+    // probability of the predicted successors over that of the more likely ones, 1 if every
+    // predicted branch is a hit
+    double ratio() const {
+        return combined.bestProb > 0 ? combined.predictedProb / combined.bestProb : 1;
+    }
+
+    void add(const PredictionAccuracy &other) {
+        profiled = profiled && other.profiled;
+        branches += other.branches;
+        uncovered += other.uncovered;
+        executions += other.executions;
+        uncoveredExecutions += other.uncoveredExecutions;
+        combined.add(other.combined);
+        for (int h = 1; h <= NumHeuristics; h++) {
+            heuristic[h].add(other.heuristic[h]);
+        }
+    }
+};
+
+PredictionAccuracy measureAccuracy(Function &F, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi, const BranchPredictionTable &table) {
+    PredictionAccuracy acc;
+    acc.profiled = F.hasProfileData();
+    double entry_freq = std::max<uint64_t>(bfi.getEntryFreq(), 1);
+    for (BasicBlock &BB : F) {
+        BranchInst *branch_inst = dyn_cast<BranchInst>(BB.getTerminator());
+        if (!branch_inst || !branch_inst->isConditional()) {
+            continue;
+        }
+        double execs = bfi.getBlockFreq(&BB).getFrequency() / entry_freq;
+        if (acc.profiled) {
+            if (Optional<uint64_t> count = bfi.getBlockProfileCount(&BB)) {
+                execs = *count;
+            }
+        }
+        acc.branches += 1;
+        acc.executions += execs;
+        const RelBranch *branch = table.lookup(&BB);
+        if (!branch) {
+            acc.uncovered += 1;
+            acc.uncoveredExecutions += execs;
+            continue;
+        }
+        BranchProbability prob = bpi.getEdgeProbability(&BB, 0u);
+        double prob_taken = prob.getNumerator() / static_cast<double>(prob.getDenominator());
+        acc.combined.count(table.direction(*branch), prob_taken, execs);
+        unsigned heuristics = table.heuristics(*branch);
+        for (int h = 1; h <= NumHeuristics; h++) {
+            if (heuristics & (1u << h)) {
+                acc.heuristic[h].count(table.predictsTaken(*branch, h), prob_taken, execs);
+            }
+        }
+    }
+    return acc;
+}
+
+// every function's accuracy, written as JSON with -superblock-accuracy-report when LLVM shuts down
+struct AccuracyReport {
+    struct Entry {
+        std::string module;
+        std::string function;
+        PredictionAccuracy accuracy;
+    };
+    std::string path;
+    std::vector<Entry> functions;
+
+    ~AccuracyReport() {
+        if (path.empty()) {
+            return;
+        }
+        std::error_code EC;
+        raw_fd_ostream os(path, EC, sys::fs::OF_Text);
+        if (EC) {
+            errs() << "superblock: cannot write " << path << ": " << EC.message() << "\n";
+            return;
+        }
+        MapVector<StringRef, PredictionAccuracy> modules;
+        for (const Entry &entry : functions) {
+            modules[entry.module].add(entry.accuracy);
+        }
+        json::OStream J(os, 2);
+        J.object([&] {
+            J.attributeArray("functions", [&] {
+                for (const Entry &entry : functions) {
+                    J.object([&] {
+                        J.attribute("module", entry.module);
+                        J.attribute("function", entry.function);
+                        writeAccuracy(J, entry.accuracy);
+                    });
+                }
+            });
+            J.attributeArray("modules", [&] {
+                for (auto &module : modules) {
+                    J.object([&] {
+                        J.attribute("module", module.first);
+                        writeAccuracy(J, module.second);
+                    });
+                }
+            });
+        });
+        os << "\n";
+    }
+
+    static void writeCounts(json::OStream &J, const AccuracyCounts &counts, unsigned branches) {
+        J.attribute("fired", counts.fired);
+        J.attribute("coverage", branches ? double(counts.fired) / branches : 0.0);
+        J.attribute("hits", counts.hits);
+        J.attribute("hit_rate", counts.fired ? double(counts.hits) / counts.fired : 0.0);
+        J.attribute("executions", counts.executions);
+        J.attribute("weighted_hit_rate", counts.executions > 0 ? counts.hitExecutions / counts.executions : 0.0);
+        J.attribute("mispredicted_executions", counts.mispredictions);
+    }
+
+    static void writeAccuracy(json::OStream &J, const PredictionAccuracy &acc) {
+        J.attribute("profiled", acc.profiled);
+        J.attribute("branches", acc.branches);
+        J.attribute("uncovered", acc.uncovered);
+        J.attribute("executions", acc.executions);
+        J.attribute("uncovered_executions", acc.uncoveredExecutions);
+        J.attribute("accuracy", acc.ratio());
+        J.attributeObject("combined", [&] { writeCounts(J, acc.combined, acc.branches); });
+        J.attributeObject("heuristics", [&] {
+            for (int h = 1; h <= NumHeuristics; h++) {
+                J.attributeObject(heuristicName(h), [&] { writeCounts(J, acc.heuristic[h], acc.branches); });
+            }
+        });
+    }
+};
+ManagedStatic<AccuracyReport> AccuracyTotals;
+
+// adds one function's accuracy to the -superblock-accuracy-report file
+void reportAccuracy(const PredictionAccuracy &accuracy, Function &F) {
+    if (SuperblockAccuracyReport.empty()) {
+        return;
+    }
+    AccuracyTotals->path = SuperblockAccuracyReport;
+    AccuracyTotals->functions.push_back({F.getParent()->getModuleIdentifier(), F.getName().str(), accuracy});
+}
+
+// --------------------------------------- the growTrace function -------------------------------------------------------
+// Dense numbering of the blocks of a function, taken before trace formation, so that the
+// visited set is a bit vector instead of a list that has to be searched on every step.
+class VisitedBlocks {
+public:
+    explicit VisitedBlocks(Function &F) {
+        for (BasicBlock &BB : F) {
+            blockNumber.try_emplace(&BB, blockNumber.size());
+        }
+        visited.resize(blockNumber.size());
+    }
+
+    bool test(const BasicBlock *BB) const {
+        return visited.test(blockNumber.lookup(BB));
+    }
+
+    void set(const BasicBlock *BB) {
+        visited.set(blockNumber.lookup(BB));
+    }
+
+private:
+    DenseMap<const BasicBlock*, unsigned> blockNumber;
+    BitVector visited;
+};
+
+// Chooses the block a trace grows into. Statically, a trace stops at branches predicted
+// with less than SuperblockMinConfidence, where duplicating the tail does not pay for
+// the code it adds. In profile mode a branch with profile data is followed
+// by the mutual most likely rule: the successor must be the most likely one, at least
+// SuperblockMinProb likely, and current must be its most frequent predecessor. Branches
+// without profile data fall back to the static heuristics.
+struct TraceSelector {
+    const BranchPredictionTable &table;
+    BranchProbabilityInfo &bpi;
+    BlockFrequencyInfo &bfi;
+    bool useProfile;
+
+    TraceSelector(Function &F, const BranchPredictionTable &table, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi)
+        : table(table), bpi(bpi), bfi(bfi), useProfile(SuperblockMode == TraceMode::Profile && F.hasProfileData()) {
+        // BPI looks an edge up by scanning the source's successors, which is quadratic over a
+        // large switch, so the probability of every edge, the most likely successor of every
+        // block and the most frequent edge into it are collected once, in function order
+        for (BasicBlock &BB : F) {
+            Instruction *terminator = BB.getTerminator();
+            for (unsigned i = 0, e = terminator->getNumSuccessors(); i < e; i++) {
+                auto inserted = edgeProbs.try_emplace({&BB, terminator->getSuccessor(i)}, BranchProbability::getZero());
+                inserted.first->second += bpi.getEdgeProbability(&BB, i);
+            }
+        }
+        for (BasicBlock &BB : F) {
+            BlockFrequency freq = bfi.getBlockFreq(&BB);
+            for (BasicBlock *succ : successors(&BB)) {
+                BranchProbability prob = edgeProb(&BB, succ);
+                auto out = likelyOut.try_emplace(&BB, succ, prob);
+                if (prob > out.first->second.second) {
+                    out.first->second = {succ, prob};
+                }
+                auto in = hottestIn.try_emplace(succ, &BB, freq * prob);
+                if (freq * prob > in.first->second.second) {
+                    in.first->second = {&BB, freq * prob};
+                }
+            }
+        }
+    }
+
+    BranchProbability edgeProb(const BasicBlock *from, const BasicBlock *to) const {
+        return edgeProbs.lookup({from, to});
+    }
+
+    bool hasProfile(BasicBlock *current) const {
+        return useProfile && (current->getSingleSuccessor() || current->getTerminator()->hasMetadata(LLVMContext::MD_prof));
+    }
+
+    // probability of the edge from -> to, from the profile or else the heuristics that chose it
+    double edgeProbability(BasicBlock *from, BasicBlock *to) const {
+        const RelBranch *branch = table.lookup(from);
+        BranchInst *branch_inst = dyn_cast<BranchInst>(from->getTerminator());
+        if (hasProfile(from) || !branch || !branch_inst || !branch_inst->isConditional()) {
+            BranchProbability prob = edgeProb(from, to);
+            return prob.getNumerator() / static_cast<double>(prob.getDenominator());
+        }
+        double taken = table.probability(*branch);
+        return (branch_inst->getSuccessor(0) == to ? taken : 0) + (branch_inst->getSuccessor(1) == to ? 1 - taken : 0);
+    }
+
+    // returns nullptr if the trace should stop at current
+    BasicBlock *next(BasicBlock *current) const {
+        if (!hasProfile(current)) {
+            if (current->getSingleSuccessor()) {
+                return current->getSingleSuccessor();
+            }
+            const RelBranch *branch = table.lookup(current);
+            if (branch && table.confidence(*branch) < SuperblockMinConfidence) {
+                SB_LOG(LogDetail, "The branch is too weakly predicted to follow.\n");
+                return nullptr;
+            }
+            BasicBlock *likely = getMostLikely(current, table);
+            if (!likely) {
+                SB_LOG(LogDetail, "No heuristic predicted the branch.\n");
+            }
+            return likely;
+        }
+        auto out = likelyOut.find(current);
+        if (out == likelyOut.end()
+            || out->second.second.getNumerator() < SuperblockMinProb * out->second.second.getDenominator()) {
+            SB_LOG(LogDetail, "No successor is likely enough to follow.\n");
+            return nullptr;
+        }
+        BasicBlock *likely = out->second.first;
+        BlockFrequency edge_freq = bfi.getBlockFreq(current) * out->second.second;
+        const auto &in = hottestIn.find(likely)->second;
+        if (in.first != current && in.second > edge_freq) {
+            SB_LOG(LogDetail, "The current block is not the most likely predecessor of its likely successor.\n");
+            return nullptr;
+        }
+        return likely;
+    }
+
+    // The predecessor a trace grows backward into from current, or nullptr if it should stop:
+    // the source of the most frequent edge into current, provided that next() picks current
+    // from it, so the mutual most likely rule holds in both directions.
+    BasicBlock *previous(BasicBlock *current) const {
+        BasicBlock *likely = nullptr;
+        BlockFrequency likely_freq;
+        for (BasicBlock *pred : predecessors(current)) {
+            BlockFrequency freq = bfi.getBlockFreq(pred) * edgeProb(pred, current);
+            if (!likely || freq > likely_freq) {
+                likely = pred;
+                likely_freq = freq;
+            }
+        }
+        if (!likely || next(likely) != current) {
+            return nullptr;
+        }
+        return likely;
+    }
+
+private:
+    using Edge = std::pair<const BasicBlock*, const BasicBlock*>;
+    DenseMap<Edge, BranchProbability> edgeProbs;  // summed over duplicate edges
+    DenseMap<const BasicBlock*, std::pair<BasicBlock*, BranchProbability>> likelyOut;
+    DenseMap<const BasicBlock*, std::pair<const BasicBlock*, BlockFrequency>> hottestIn;
+};
+
+// Grows a trace from its seed. With backward set it first extends the trace upwards through
+// predecessors, then grows forward from the seed as before. Backward growth stops at a loop
+// header, whose back edge would otherwise become a side entrance in the middle of the trace.
+Trace growTrace(BasicBlock* current_block, DominatorTree& dom_tree, const TraceSelector &selector, VisitedBlocks &visited,
+                bool backward = false){
+    //initialize trace with current_block, and whatever leads to it
+    std::vector<BasicBlock*> trace_blocks;
+    if (backward) {
+        visited.set(current_block);
+        BasicBlock *first = current_block;
+        auto is_header = [&](BasicBlock *BB) {
+            return llvm::any_of(predecessors(BB), [&](BasicBlock *pred) { return dom_tree.dominates(BB, pred); });
+        };
+        while (!is_header(first)) {
+            BasicBlock *pred = selector.previous(first);
+            if (!pred || visited.test(pred)) {
+                break;
+            }
+            SB_LOG(LogDetail, "Growing backward into " << pred->getName() << "\n");
+            visited.set(pred);
+            trace_blocks.push_back(pred);
+            first = pred;
+        }
+        std::reverse(trace_blocks.begin(), trace_blocks.end());
+    }
+    trace_blocks.push_back(current_block);
+
+    //trace out the optimal path through loop according to hazard-avoidance and heuristics
+    while(1){
+        visited.set(current_block);
+        //check if current block ends in a subroutine return or indirect jump
+        Instruction *terminator = current_block->getTerminator();
+        if(isa<ReturnInst>(terminator)){
+            SB_LOG(LogDetail, "Found a subroutine return!" << "\n");
+            return Trace(trace_blocks); // stop growing the trace
+        }
+        if(isa<IndirectBrInst>(terminator)){
+            SB_LOG(LogDetail, "Found an indirect jump!" << "\n");
+            return Trace(trace_blocks); //stop growing trace
+        }
+        //get the likely block from the profile or the heuristics (loop heuristic accounts for coming out of the loop)
+        BasicBlock* likely_block = selector.next(current_block);
+        if(!likely_block){
+            return Trace(trace_blocks);
+        }
+        //check if likely_block has been visited, and if not, add it to the trace
+        if (!visited.test(likely_block)){
+            // the likely_block has not been visited
+            if(dom_tree.dominates(likely_block, current_block)){
+                SB_LOG(LogDetail, "The likely block dominates the current block! Stop! \n");
+                return Trace(trace_blocks);
+            }
+            
+            //then likely does not dominate current
+            SB_LOG(LogDetail, "The likely block does not dominate the current block.\n");
+            trace_blocks.push_back(likely_block);
+            current_block = likely_block;
+        }else{
+            return Trace(trace_blocks);
+        }
+    }
+}
+        
+// How much duplicating each trace's tails gains, recorded while BFI and BPI still describe the CFG
+struct TraceWeights {
+    bool profiled = false;                // the frequencies come from a profile, not from estimates
+    uint64_t entryFreq = 0;
+    std::vector<double> reachProb;        // probability that the trace runs from its entry through block i
+    std::vector<uint64_t> sideEntryFreq;  // frequency of entering block i from outside the trace
+};
+
+// what tail duplication did to one function
+struct DuplicationReport {
+    unsigned duplicatedTails = 0;
+    unsigned duplicatedInsts = 0;
+    unsigned rejectedTails = 0;
+    unsigned rejectedInsts = 0;
+
+    void add(const DuplicationReport &other) {
+        duplicatedTails += other.duplicatedTails;
+        duplicatedInsts += other.duplicatedInsts;
+        rejectedTails += other.rejectedTails;
+        rejectedInsts += other.rejectedInsts;
+    }
+
+    void print(raw_ostream &os, StringRef name) const {
+        os << "Tail duplication in " << name << ": duplicated " << duplicatedInsts << " instructions in "
+           << duplicatedTails << " tails, rejected " << rejectedInsts << " instructions in " << rejectedTails << " tails\n";
+    }
+};
+
+// instructions tail duplication added across the functions of a module
+struct DuplicationBudget {
+    uint64_t moduleDuplicated = 0;
+
+    bool allows(uint64_t cost) const {
+        return SuperblockDupModuleBudget == 0 || moduleDuplicated + cost <= SuperblockDupModuleBudget;
+    }
+};
+
+// ------------------------------------------- per-function context ----------------------------------------------------
+// Everything superblock formation knows about one function. Trace formation only reads the IR,
+// so contexts for different functions can be filled in concurrently; tail duplication then
+// rewrites each function on its own.
+struct SuperblockContext {
+    const BranchPredictionTable *table = nullptr;  // owned by the function analysis manager
+    std::list<Trace> traces;
+    std::vector<TraceWeights> weights;  // one per trace, in the same order
+    DuplicationReport duplication;
+    DenseMap<const BasicBlock*, uint64_t> frequencies;  // block frequencies before any rewriting
+    PredictionAccuracy accuracy;  // of the static predictions, before any rewriting
+    std::string log;
+    StringMap<TimeRecord> times;  // per phase
+};
+
+TraceWeights weighTrace(const Trace &curr_trace, const TraceSelector &selector, BlockFrequencyInfo &bfi) {
+    TraceWeights weights;
+    weights.profiled = selector.useProfile;
+    SmallPtrSet<const BasicBlock*, 16> in_trace(curr_trace.begin(), curr_trace.end());
+    weights.entryFreq = bfi.getBlockFreq(curr_trace.getEntryBasicBlock()).getFrequency();
+    double reach = 1.0;
+    for (unsigned i = 0; i < curr_trace.size(); i++) {
+        BasicBlock *bb = curr_trace.getBlock(i);
+        if (i > 0) {
+            reach *= selector.edgeProbability(curr_trace.getBlock(i - 1), bb);
+        }
+        uint64_t side_freq = 0;
+        for (BasicBlock *pred : predecessors(bb)) {
+            if (!in_trace.count(pred)) {
+                side_freq += (bfi.getBlockFreq(pred) * selector.edgeProb(pred, bb)).getFrequency();
+            }
+        }
+        weights.reachProb.push_back(reach);
+        weights.sideEntryFreq.push_back(side_freq);
+    }
+    return weights;
+}
+
+void logTrace(const Trace &curr_trace) {
+    if (SuperblockVerbose < LogDetail) {
+        return;
+    }
+    logs() << "New trace:";
+    for (BasicBlock *bb : curr_trace) {
+        logs() << " " << bb->getName();
+    }
+    logs() << "\n";
+}
+
+// forms the traces of F from its static predictions, without modifying it
+void formTraces(Function &F, DominatorTree &dt, LoopInfo &li, BranchProbabilityInfo &bpi, BlockFrequencyInfo &bfi,
+                const BranchPredictionTable &table, SuperblockContext &ctx) {
+    ctx.table = &table;
+
+    PhaseTimer timer(F.getName());
+    timer.enter("seed ordering");
+    std::list<Trace> &traces = ctx.traces;
+    TraceSelector selector(F, table, bpi, bfi);
+    VisitedBlocks visited(F);
+    for (BasicBlock &BB : F) {
+        ctx.frequencies[&BB] = bfi.getBlockFreq(&BB).getFrequency();
+    }
+    if (SuperblockSeeds == SeedOrder::Hottest) {
+        // ------------------------------------ trace formation: hottest first -----------------------------------------
+        // every trace starts at the most frequent block no trace has taken yet, so a lukewarm
+        // block can never start a trace that takes over the hot path below it
+        std::vector<BasicBlock*> seeds;
+        for (BasicBlock &BB : F) {
+            if (dt.isReachableFromEntry(&BB)) {
+                seeds.push_back(&BB);
+            }
+        }
+        std::stable_sort(seeds.begin(), seeds.end(), [&](BasicBlock *a, BasicBlock *b) {
+            return ctx.frequencies.lookup(a) > ctx.frequencies.lookup(b);
+        });
+
+        timer.enter("trace growth");
+        for (BasicBlock *seed : seeds) {
+            if (!visited.test(seed)) {
+                Trace temp_trace = growTrace(seed, dt, selector, visited, true);
+                traces.push_back(temp_trace);
+                logTrace(temp_trace);
+            }
+        }
+    }
+    else {
+        timer.enter("loop ordering");
+        // ------------------------------------------ identifying loops ------------------------------------------------
+        // reverse preorder visits every loop after all of the loops nested inside of it, so the
+        // most nested loop bodies get the first pick of blocks
+        SmallVector<Loop*, 8> most_to_least_nested = li.getLoopsInReverseSiblingPreorder();
+
+        //sanity check: print out loop depths to check they were ordered correctly. 
+        for (Loop* temp_loop : most_to_least_nested){
+            SB_LOG(LogDetail, "Loop depth: " << temp_loop->getLoopDepth() << "\n");
+        }
+
+        // -------------------------------------- trace formation: loop bodies -----------------------------------------
+        timer.enter("trace growth");
+
+        //form traces with the loop bodies first
+        for (Loop* current_loop : most_to_least_nested){
+            SB_LOG(LogDetail, "Starting new list of loop blocks! -------------- \n");
+
+            // reverse post-order of the loop body, starting at the header and ignoring backedges
+            LoopBlocksRPO loop_rpo(current_loop);
+            loop_rpo.perform(&li);
+
+            // iterate through blocks in loop and form traces
+            for(BasicBlock* current_block : loop_rpo){
+                if (!visited.test(current_block)){
+                    // the current_block has not been visited
+                    Trace temp_trace = growTrace(current_block, dt, selector, visited);
+                    traces.push_back(temp_trace);
+                    logTrace(temp_trace);
+                }
+            }
+        }
+        // ---------------------------------------- trace formation: function blocks -----------------------------------
+        //now do trace formation for remaining function blocks, in reverse post-order from the entry block
+        ReversePostOrderTraversal<Function*> function_rpo(&F);
+        for(BasicBlock* current_block : function_rpo){
+            if (!visited.test(current_block)){
+                // the current_block has not been visited
+                Trace temp_trace = growTrace(current_block, dt, selector, visited);
+                traces.push_back(temp_trace);
+                logTrace(temp_trace);
+            }
+        }
+    }
+
+    timer.enter("trace weights");
+    unsigned trace_blocks = 0;
+    for (const Trace &curr_trace : traces) {
+        ctx.weights.push_back(weighTrace(curr_trace, selector, bfi));
+        trace_blocks += curr_trace.size();
+        MaxTraceLength.updateMax(curr_trace.size());
+    }
+    NumTraces += traces.size();
+    NumTraceBlocks += trace_blocks;
+    SB_LOG(LogSummary, F.getName() << ": " << traces.size() << " traces, average length "
+           << format("%.2f", traces.empty() ? 0.0 : double(trace_blocks) / traces.size()) << "\n");
+
+    //calculate accuracy compared to profile information, before tail duplication changes the CFG under bpi
+    ctx.accuracy = measureAccuracy(F, bpi, bfi, table);
+    SB_LOG(LogSummary, "Accuracy is: " << ctx.accuracy.ratio() << ", " << ctx.accuracy.uncovered << " of "
+           << ctx.accuracy.branches << " branches not predicted\n");
+}
+
+// Cost model for duplicating the tail below side entrance i of a trace. The tail may be at most
+// SuperblockDupThreshold instructions scaled by the probability the trace reaches the side entrance,
+// with a profile the side entrance must not be hotter than the trace flowing through it, and the function and module
+// growth budgets must allow it. Returns why the tail is rejected, or nullptr if it is worth duplicating.
+const char *rejectTail(const TraceWeights &weights, unsigned i, unsigned cost, unsigned function_left, const DuplicationBudget &budget) {
+    double trace_flow = weights.entryFreq * weights.reachProb[i];
+    if (cost > SuperblockDupThreshold * weights.reachProb[i]) {
+        return "it is too large for how rarely the trace reaches it";
+    }
+    if (weights.profiled && weights.sideEntryFreq[i] > trace_flow) {
+        return "the side entrance is hotter than the trace";
+    }
+    if (cost > function_left) {
+        return "it exceeds the function growth budget";
+    }
+    if (!budget.allows(cost)) {
+        return "it exceeds the module growth budget";
+    }
+    return nullptr;
+}
+
+// Rewrites every use of a value of original, and of its copies, outside the block that defines it
+// to whichever definition reaches it, with phis where several do. Each copy is a block and the map
+// it was cloned with; a value the map has no copy of is the same in that block as in original.
+void rewriteUsesAcrossCopies(BasicBlock *original, ArrayRef<std::pair<BasicBlock*, const ValueToValueMapTy*>> copies) {
+    SSAUpdater ssa_updater;
+    for (Instruction &I : *original) {
+        if (I.getType()->isVoidTy()) {
+            continue;
+        }
+        SmallVector<Value*, 4> values;
+        for (const auto &copy : copies) {
+            Value *value = copy.second->lookup(&I);
+            values.push_back(value ? value : &I);
+        }
+        SmallVector<Use*, 8> uses;
+        auto collectUses = [&](Instruction *def) {
+            for (Use &U : def->uses()) {
+                Instruction *user = cast<Instruction>(U.getUser());
+                BasicBlock *use_bb = user->getParent();
+                if (PHINode *phi = dyn_cast<PHINode>(user)) {
+                    use_bb = phi->getIncomingBlock(U);
+                }
+                if (use_bb != def->getParent()) {
+                    uses.push_back(&U);
+                }
+            }
+        };
+        collectUses(&I);
+        for (unsigned k = 0; k < copies.size(); k++) {
+            Instruction *cloned_inst = dyn_cast<Instruction>(values[k]);
+            if (cloned_inst && cloned_inst->getParent() == copies[k].first) {
+                collectUses(cloned_inst);
+            }
+        }
+        if (uses.empty()) {
+            continue;
+        }
+        ssa_updater.Initialize(I.getType(), I.getName());
+        ssa_updater.AddAvailableValue(original, &I);
+        for (unsigned k = 0; k < copies.size(); k++) {
+            ssa_updater.AddAvailableValue(copies[k].first, values[k]);
+        }
+        for (Use *U : uses) {
+            ssa_updater.RewriteUse(*U);
+        }
+    }
+}
+
+// Duplicates the tail of curr_trace from its side-entered block at index start, and moves every
+// side entrance at or below start onto the copy, so that the trace is only entered at its top.
+// Returns the cloned blocks. The new and moved edges are queued on dtu.
+std::vector<BasicBlock*> duplicateTail(Function &F, const Trace &curr_trace, unsigned start, DomTreeUpdater &dtu) {
+    PhaseTimer timer(F.getName());
+    timer.enter("tail duplication");
+    ValueToValueMapTy VMap;
+    std::vector<BasicBlock*> tail;
+    std::vector<BasicBlock*> clones;
+    DenseMap<BasicBlock*, BasicBlock*> original_of;
+    for (unsigned i = start; i < curr_trace.size(); i++) {
+        BasicBlock *bb = curr_trace.getBlock(i);
+        BasicBlock *cloned_bb = CloneBasicBlock(bb, VMap, ".sb", &F);
+        VMap[bb] = cloned_bb;
+        original_of[cloned_bb] = bb;
+        tail.push_back(bb);
+        clones.push_back(cloned_bb);
+    }
+
+    // the clones' phis need the values flowing in from each predecessor before anything is rewired
+    // (keyed by block, merge blocks can have thousands of predecessors)
+    DenseMap<PHINode*, DenseMap<BasicBlock*, Value*>> incoming;
+    for (unsigned i = 0; i < tail.size(); i++) {
+        auto clone_phi = clones[i]->begin();
+        for (PHINode &phi : tail[i]->phis()) {
+            PHINode *cloned_phi = cast<PHINode>(&*clone_phi++);
+            auto &entries = incoming[cloned_phi];
+            for (unsigned j = 0; j < phi.getNumIncomingValues(); j++) {
+                entries.try_emplace(phi.getIncomingBlock(j), phi.getIncomingValue(j));
+            }
+        }
+    }
+
+    // uses inside the copy refer to the copy, including branches between tail blocks
+    for (BasicBlock *cloned_bb : clones) {
+        for (Instruction &I : *cloned_bb) {
+            RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+        }
+    }
+
+    // every entrance to a tail block other than from the block above it in the trace moves to the copy
+    SmallVector<DominatorTree::UpdateType, 16> dt_updates;
+    for (unsigned i = 0; i < tail.size(); i++) {
+        BasicBlock *trace_pred = curr_trace.getBlock(start + i - 1);
+        SmallSetVector<BasicBlock*, 4> side_preds;
+        for (BasicBlock *pred : predecessors(tail[i])) {
+            if (pred != trace_pred) {
+                side_preds.insert(pred);
+            }
+        }
+        for (BasicBlock *pred : side_preds) {
+            SB_LOG(LogDetail, "Moving side entrance from " << pred->getName() << " to " << clones[i]->getName() << "\n");
+            pred->getTerminator()->replaceSuccessorWith(tail[i], clones[i]);
+            dt_updates.push_back({DominatorTree::Delete, pred, tail[i]});
+            dt_updates.push_back({DominatorTree::Insert, pred, clones[i]});
+        }
+    }
+    for (BasicBlock *cloned_bb : clones) {
+        for (BasicBlock *succ : successors(cloned_bb)) {
+            dt_updates.push_back({DominatorTree::Insert, cloned_bb, succ});
+        }
+    }
+    dtu.applyUpdates(dt_updates);
+
+    // rebuild the phis of the tail and of its copy from their final predecessors
+    auto rebuildPhis = [](BasicBlock *bb, const std::function<Value*(PHINode&, BasicBlock*)> &valueFor) {
+        SmallVector<BasicBlock*, 4> preds(predecessors(bb));
+        for (PHINode &phi : bb->phis()) {
+            SmallVector<Value*, 4> values;
+            for (BasicBlock *pred : preds) {
+                values.push_back(valueFor(phi, pred));
+            }
+            while (phi.getNumIncomingValues() > 0) {
+                phi.removeIncomingValue(phi.getNumIncomingValues() - 1, false);
+            }
+            for (unsigned j = 0; j < preds.size(); j++) {
+                phi.addIncoming(values[j], preds[j]);
+            }
+        }
+    };
+    for (unsigned i = 0; i < tail.size(); i++) {
+        rebuildPhis(tail[i], [](PHINode &phi, BasicBlock *pred) {
+            return phi.getIncomingValueForBlock(pred);
+        });
+        rebuildPhis(clones[i], [&](PHINode &phi, BasicBlock *pred) -> Value* {
+            // an edge from another copied block carries the copy of the value from its original
+            // (the copied blocks are new, so they never appear among the original incoming blocks)
+            auto &entries = incoming[&phi];
+            if (Value *value = entries.lookup(pred)) {
+                return value;
+            }
+            if (BasicBlock *original_pred = original_of.lookup(pred)) {
+                if (Value *value = entries.lookup(original_pred)) {
+                    Value *mapped = VMap.lookup(value);
+                    return mapped ? mapped : value;
+                }
+            }
+            return UndefValue::get(phi.getType());
+        });
+    }
+
+    // blocks the copy exits to get an incoming entry for it, carrying the copied value
+    SmallPtrSet<BasicBlock*, 16> in_copy(clones.begin(), clones.end());
+    for (unsigned i = 0; i < tail.size(); i++) {
+        for (BasicBlock *succ : successors(clones[i])) {
+            if (in_copy.count(succ)) {
+                continue;
+            }
+            for (PHINode &phi : succ->phis()) {
+                Value *value = phi.getIncomingValueForBlock(tail[i]);
+                Value *mapped = VMap.lookup(value);
+                phi.addIncoming(mapped ? mapped : value, clones[i]);
+            }
+        }
+    }
+
+    // Both a tail value and its copy now reach the blocks where the trace and the copy merge again,
+    // and a copied block entered from the original tail (a forward edge inside the trace) sees the
+    // original value rather than the copy. Every use outside the defining block is rewritten to
+    // whichever definition reaches it, with phis where both do.
+    timer.enter("use fixup");
+    for (unsigned i = 0; i < tail.size(); i++) {
+        rewriteUsesAcrossCopies(tail[i], {{clones[i], &VMap}});
+    }
+    return clones;
+}
+
+// Tail duplicates every trace in ctx, returns true if F was changed. A trace's tail is copied once,
+// from the first side entrance whose tail the cost model accepts, which removes all side entrances
+// below it as well. The dominator tree is updated through dtu. A copied block joins the loops of
+// its original, unless the tail holds a loop header: its back edges move to the copy, which
+// reshapes the loop, and li is recomputed once at the end instead.
+bool tailDuplicateTraces(Function &F, SuperblockContext &ctx, DuplicationBudget &budget, DomTreeUpdater &dtu, LoopInfo &li,
+                         OptimizationRemarkEmitter &ore) {
+    unsigned function_left = F.getInstructionCount() * SuperblockDupFunctionGrowth / 100;
+    unsigned trace_index = 0;
+    bool changed = false;
+    bool loops_changed = false;
+    for(Trace &curr_trace : ctx.traces){
+        const TraceWeights &weights = ctx.weights[trace_index++];
+        // the cost of a tail is everything from its side entrance to the end of the trace
+        std::vector<unsigned> tail_cost(curr_trace.size() + 1, 0);
+        for(int i = curr_trace.size() - 1; i >= 0; i--){
+            tail_cost[i] = tail_cost[i + 1] + curr_trace.getBlock(i)->size();
+        }
+        for(unsigned i = 1; i < curr_trace.size(); i++){
+            BasicBlock* curr_bb = curr_trace.getBlock(i);
+            BasicBlock* trace_pred = curr_trace.getBlock(i - 1);
+            bool side_entered = llvm::any_of(predecessors(curr_bb), [&](BasicBlock* pred){ return pred != trace_pred; });
+            if(!side_entered){
+                continue;
+            }
+            SB_LOG(LogDetail, "The length of the trace is: " << curr_trace.size() << " and the side entrance is at "<< i <<"\n");
+            unsigned cost = tail_cost[i];
+            if(const char *reason = rejectTail(weights, i, cost, function_left, budget)){
+                SB_LOG(LogDetail, "Not duplicating the tail of " << cost << " instructions, " << reason << "\n");
+                ore.emit([&]() {
+                    return OptimizationRemarkMissed(DEBUG_TYPE, "TailNotDuplicated", curr_bb->getFirstNonPHI())
+                           << "tail of " << ore::NV("Instructions", cost) << " instructions below this side entrance not duplicated: "
+                           << reason;
+                });
+                ctx.duplication.rejectedTails++;
+                ctx.duplication.rejectedInsts += cost;
+                ++NumRejectedTails;
+                continue;
+            }
+            function_left -= cost;
+            budget.moduleDuplicated += cost;
+            ctx.duplication.duplicatedTails++;
+            ctx.duplication.duplicatedInsts += cost;
+            for(unsigned j = i; j < curr_trace.size() && !loops_changed; j++){
+                loops_changed = li.isLoopHeader(curr_trace.getBlock(j));
+            }
+            ore.emit([&]() {
+                return OptimizationRemark(DEBUG_TYPE, "TailDuplicated", curr_bb->getFirstNonPHI())
+                       << "duplicated the tail of " << ore::NV("Blocks", unsigned(curr_trace.size() - i)) << " blocks ("
+                       << ore::NV("Instructions", cost) << " instructions) below this side entrance";
+            });
+            std::vector<BasicBlock*> clones = duplicateTail(F, curr_trace, i, dtu);
+            ++NumDuplicatedTails;
+            NumDuplicatedBlocks += clones.size();
+            NumDuplicatedInsts += cost;
+            for(unsigned j = 0; j < clones.size() && !loops_changed; j++){
+                if(Loop *loop = li.getLoopFor(curr_trace.getBlock(i + j))){
+                    loop->addBasicBlockToLoop(clones[j], li);
+                }
+            }
+            changed = true;
+            break;
+        }
+    }
+    if(loops_changed){
+        PhaseTimer timer(F.getName());
+        timer.enter("loop info update");
+        SB_LOG(LogSummary, "A loop header was duplicated, recomputing loop info\n");
+        li.releaseMemory();
+        li.analyze(dtu.getDomTree());
+    }
+
+    if (SuperblockVerbose >= LogSummary) {
+        ctx.duplication.print(logs(), F.getName());
+    }
+    return changed;
+}
+
+// ------------------------------------------- superblock enlargement ---------------------------------------------------
+// Superblocks that loop back to their own entry, or that are short, have little to schedule
+// in. Three transformations make them longer by copying superblocks, all bounded by the largest
+// superblock they may produce and by the function and module growth budgets:
+//   - a superblock loop (its entry is the header of the innermost loop holding all of its
+//     blocks, its last block branches back there) is unrolled: copies of its body are chained
+//     one after another, each keeping all of its side exits;
+//   - a superblock loop with a small trip count is peeled instead, its first iterations copied
+//     in front of the loop;
+//   - a short superblock that most likely continues into another one absorbs a copy of it,
+//     from the block it branches to on (branch target expansion).
+
+// true if every block of blocks can be copied and only the first is entered from outside
+bool canCopySuperblock(ArrayRef<BasicBlock*> blocks) {
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        BasicBlock *bb = blocks[i];
+        if (bb->isEHPad() || isa<IndirectBrInst>(bb->getTerminator()) || isa<CallBrInst>(bb->getTerminator())) {
+            return false;
+        }
+        if (i > 0 && llvm::any_of(predecessors(bb), [&](BasicBlock *pred) { return pred != blocks[i - 1]; })) {
+            return false;
+        }
+        for (Instruction &I : *bb) {
+            // a token cannot flow through the phis the copies need
+            if (I.getType()->isTokenTy()) {
+                return false;
+            }
+            if (auto *call = dyn_cast<CallBase>(&I)) {
+                if (call->cannotDuplicate() || call->isConvergent()) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+unsigned superblockSize(ArrayRef<BasicBlock*> blocks) {
+    unsigned size = 0;
+    for (BasicBlock *bb : blocks) {
+        size += bb->size();
+    }
+    return size;
+}
+
+// Copies the superblock blocks, headed by blocks[0], count times in a chain. The first copy is
+// entered from entry_pred instead of the head, every later copy from the last block of the copy
+// before it, which must branch to the head. A copy's head has no phis: their uses see the values
+// flowing in along that edge. Every other edge to the head, including the last copy's, still goes
+// to the original head, and side exits leave to the blocks the original leaves to. Returns the
+// copies, each in superblock order. The new and moved edges are queued on dtu.
+std::vector<std::vector<BasicBlock*>> chainCopies(Function &F, ArrayRef<BasicBlock*> blocks, BasicBlock *entry_pred,
+                                                  unsigned count, StringRef suffix, DomTreeUpdater &dtu) {
+    BasicBlock *head = blocks.front();
+    BasicBlock *last = blocks.back();
+    SmallPtrSet<BasicBlock*, 16> in_superblock(blocks.begin(), blocks.end());
+    // the values the head's phis receive along every edge that is moved or copied, before any rewiring
+    DenseMap<std::pair<PHINode*, BasicBlock*>, Value*> head_in;
+    for (PHINode &phi : head->phis()) {
+        for (unsigned j = 0; j < phi.getNumIncomingValues(); j++) {
+            BasicBlock *pred = phi.getIncomingBlock(j);
+            if (pred == entry_pred || in_superblock.count(pred)) {
+                head_in.try_emplace({&phi, pred}, phi.getIncomingValue(j));
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<ValueToValueMapTy>> maps;
+    std::vector<std::vector<BasicBlock*>> copies;
+    // the copy of value in copy k, where copy 0 is the original
+    auto mapped = [&](unsigned k, Value *value) {
+        if (k == 0) {
+            return value;
+        }
+        Value *copy = maps[k - 1]->lookup(value);
+        return copy ? copy : value;
+    };
+
+    // every copy is cloned before any edge moves, so that all of them copy the original edges
+    BasicBlock *pred_original = entry_pred;
+    for (unsigned k = 1; k <= count; k++) {
+        maps.push_back(std::make_unique<ValueToValueMapTy>());
+        ValueToValueMapTy &VMap = *maps.back();
+        std::vector<BasicBlock*> copy;
+        for (BasicBlock *bb : blocks) {
+            BasicBlock *cloned_bb = CloneBasicBlock(bb, VMap, suffix + Twine(k), &F);
+            VMap[bb] = cloned_bb;
+            copy.push_back(cloned_bb);
+        }
+        for (PHINode &phi : head->phis()) {
+            PHINode *cloned_phi = cast<PHINode>(VMap[&phi]);
+            VMap[&phi] = mapped(k - 1, head_in.lookup({&phi, pred_original}));
+            cloned_phi->eraseFromParent();
+        }
+        for (BasicBlock *cloned_bb : copy) {
+            for (Instruction &I : *cloned_bb) {
+                RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+            }
+            cloned_bb->getTerminator()->replaceSuccessorWith(copy.front(), head);
+        }
+        copies.push_back(std::move(copy));
+        pred_original = last;
+    }
+    SmallVector<DominatorTree::UpdateType, 16> dt_updates;
+    entry_pred->getTerminator()->replaceSuccessorWith(head, copies.front().front());
+    dt_updates.push_back({DominatorTree::Delete, entry_pred, head});
+    dt_updates.push_back({DominatorTree::Insert, entry_pred, copies.front().front()});
+    for (unsigned k = 1; k < count; k++) {
+        copies[k - 1].back()->getTerminator()->replaceSuccessorWith(head, copies[k].front());
+    }
+
+    // entry_pred no longer reaches the head; every copied block that does passes on its copy of the value
+    for (PHINode &phi : head->phis()) {
+        while (phi.getBasicBlockIndex(entry_pred) >= 0) {
+            phi.removeIncomingValue(entry_pred, false);
+        }
+    }
+    for (unsigned k = 1; k <= count; k++) {
+        const std::vector<BasicBlock*> &copy = copies[k - 1];
+        SmallPtrSet<BasicBlock*, 16> in_copy(copy.begin(), copy.end());
+        for (unsigned i = 0; i < copy.size(); i++) {
+            SmallPtrSet<BasicBlock*, 4> seen;
+            for (BasicBlock *succ : successors(copy[i])) {
+                if (seen.insert(succ).second) {
+                    dt_updates.push_back({DominatorTree::Insert, copy[i], succ});
+                }
+                if (succ == head) {
+                    for (PHINode &phi : head->phis()) {
+                        phi.addIncoming(mapped(k, head_in.lookup({&phi, blocks[i]})), copy[i]);
+                    }
+                }
+                else if (!in_copy.count(succ)) {
+                    for (PHINode &phi : succ->phis()) {
+                        phi.addIncoming(mapped(k, phi.getIncomingValueForBlock(blocks[i])), copy[i]);
+                    }
+                }
+            }
+        }
+    }
+    dtu.applyUpdates(dt_updates);
+
+    // every use outside the defining block is rewritten to whichever copy of the value reaches it;
+    // in a copy's head the value of a phi is what flowed in along its entry, which its map holds
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        SmallVector<std::pair<BasicBlock*, const ValueToValueMapTy*>, 4> block_copies;
+        for (unsigned k = 1; k <= count; k++) {
+            block_copies.push_back({copies[k - 1][i], maps[k - 1].get()});
+        }
+        rewriteUsesAcrossCopies(blocks[i], block_copies);
+    }
+    return copies;
+}
+
+// Enlarges the superblocks of ctx, hottest first, and returns true if F was changed. Every
+// superblock loop is unrolled or peeled, then every short superblock is expanded. The
+// dominator tree is updated through dtu, and li is recomputed once at the end.
+bool enlargeSuperblocks(Function &F, SuperblockContext &ctx, DuplicationBudget &budget, DomTreeUpdater &dtu, LoopInfo &li,
+                        OptimizationRemarkEmitter &ore) {
+    PhaseTimer timer(F.getName());
+    timer.enter("enlargement");
+    unsigned function_left = F.getInstructionCount() * SuperblockEnlargeFunctionGrowth / 100;
+    auto affordable = [&](unsigned cost) { return cost <= function_left && budget.allows(cost); };
+    auto spend = [&](unsigned cost) {
+        function_left -= cost;
+        budget.moduleDuplicated += cost;
+        NumEnlargedInsts += cost;
+    };
+
+    uint64_t max_freq = 0;
+    for (auto &entry : ctx.frequencies) {
+        max_freq = std::max(max_freq, entry.second);
+    }
+    std::vector<Trace*> ordered;
+    for (Trace &curr_trace : ctx.traces) {
+        uint64_t freq = ctx.frequencies.lookup(curr_trace.getEntryBasicBlock());
+        if (freq > 0 && freq >= SuperblockColdFreq * max_freq) {
+            ordered.push_back(&curr_trace);
+        }
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [&](const Trace *a, const Trace *b) {
+        return ctx.frequencies.lookup(a->getEntryBasicBlock()) > ctx.frequencies.lookup(b->getEntryBasicBlock());
+    });
+
+    bool changed = false;
+    for (Trace *curr_trace : ordered) {
+        std::vector<BasicBlock*> blocks(curr_trace->begin(), curr_trace->end());
+        BasicBlock *header = blocks.front();
+        BasicBlock *last = blocks.back();
+        Loop *loop = li.getLoopFor(header);
+        if (!loop || loop->getHeader() != header || !is_contained(successors(last), header) ||
+            llvm::any_of(blocks, [&](BasicBlock *bb) { return li.getLoopFor(bb) != loop; }) || !canCopySuperblock(blocks)) {
+            continue;
+        }
+        unsigned size = superblockSize(blocks);
+        unsigned trips = ctx.table->tripCount(header);
+
+        // Peeling every iteration but the last straightens out the whole loop when it runs its trip
+        // count. The peeled copies sit outside the loop, so any block of the loop off the superblock
+        // would gain a second entrance; only loops the superblock covers entirely are peeled.
+        BasicBlock *outside_pred = loop->getLoopPredecessor();
+        if (trips >= 2 && trips <= SuperblockPeelMaxTrips) {
+            unsigned cost = size * (trips - 1);
+            if (outside_pred && loop->getNumBlocks() == blocks.size() && size * trips <= SuperblockEnlargeMaxSize &&
+                affordable(cost)) {
+                SB_LOG(LogDetail, "Peeling " << trips - 1 << " iterations of the superblock loop at " << header->getName() << "\n");
+                ore.emit([&]() {
+                    return OptimizationRemark(DEBUG_TYPE, "SuperblockPeeled", header->getFirstNonPHI())
+                           << "peeled " << ore::NV("Iterations", trips - 1) << " iterations of a superblock loop of "
+                           << ore::NV("Instructions", size) << " instructions";
+                });
+                std::vector<std::vector<BasicBlock*>> copies = chainCopies(F, blocks, outside_pred, trips - 1, ".peel", dtu);
+                std::vector<BasicBlock*> enlarged;
+                for (const std::vector<BasicBlock*> &copy : copies) {
+                    enlarged.insert(enlarged.end(), copy.begin(), copy.end());
+                }
+                enlarged.insert(enlarged.end(), blocks.begin(), blocks.end());
+                ctx.frequencies[enlarged.front()] = ctx.frequencies.lookup(header);
+                *curr_trace = Trace(enlarged);
+                spend(cost);
+                ++NumPeeledLoops;
+                changed = true;
+            }
+            // a loop this short gains little from unrolling
+            continue;
+        }
+
+        // copies keep every side exit, so no remainder loop is needed for any trip count
+        unsigned factor = std::min<unsigned>(SuperblockUnrollFactor, SuperblockEnlargeMaxSize / std::max(size, 1u));
+        if (trips) {
+            factor = std::min(factor, trips);
+        }
+        // as many copies as the budgets still allow
+        while (factor >= 2 && !affordable(size * (factor - 1))) {
+            factor--;
+        }
+        if (factor < 2) {
+            SB_LOG(LogDetail, "Not unrolling the superblock loop at " << header->getName() << "\n");
+            continue;
+        }
+        unsigned cost = size * (factor - 1);
+        SB_LOG(LogDetail, "Unrolling the superblock loop at " << header->getName() << " by " << factor << "\n");
+        ore.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "SuperblockUnrolled", header->getFirstNonPHI())
+                   << "unrolled a superblock loop of " << ore::NV("Instructions", size) << " instructions by "
+                   << ore::NV("UnrollCount", factor);
+        });
+        std::vector<std::vector<BasicBlock*>> copies = chainCopies(F, blocks, last, factor - 1, ".unroll", dtu);
+        for (const std::vector<BasicBlock*> &copy : copies) {
+            blocks.insert(blocks.end(), copy.begin(), copy.end());
+        }
+        *curr_trace = Trace(blocks);
+        spend(cost);
+        ++NumUnrolledLoops;
+        changed = true;
+    }
+
+    // where each block sits in the superblocks, to find the one a short superblock continues into
+    DenseMap<BasicBlock*, std::pair<Trace*, unsigned>> trace_at;
+    for (Trace &curr_trace : ctx.traces) {
+        for (unsigned i = 0; i < curr_trace.size(); i++) {
+            trace_at[curr_trace.getBlock(i)] = {&curr_trace, i};
+        }
+    }
+    for (Trace *curr_trace : ordered) {
+        std::vector<BasicBlock*> blocks(curr_trace->begin(), curr_trace->end());
+        unsigned size = superblockSize(blocks);
+        if (size >= SuperblockExpandMaxSize) {
+            continue;
+        }
+        BasicBlock *last = blocks.back();
+        BasicBlock *target = last->getSingleSuccessor();
+        if (!target) {
+            const RelBranch *branch = ctx.table->lookup(last);
+            if (branch && ctx.table->confidence(*branch) >= SuperblockMinConfidence) {
+                target = getMostLikely(last, *ctx.table);
+            }
+        }
+        // the target is the entry of another superblock, or a side entrance tail duplication
+        // left in place; either way the copy runs from it to the end of that superblock
+        auto found = target ? trace_at.find(target) : trace_at.end();
+        if (found == trace_at.end() || found->second.first == curr_trace) {
+            continue;
+        }
+        Trace *target_trace = found->second.first;
+        std::vector<BasicBlock*> target_blocks(target_trace->begin() + found->second.second, target_trace->end());
+        // copying a loop header would give the loop a second entrance
+        if (llvm::any_of(target_blocks, [&](BasicBlock *bb) { return li.isLoopHeader(bb); }) ||
+            !canCopySuperblock(target_blocks)) {
+            continue;
+        }
+        unsigned cost = superblockSize(target_blocks);
+        if (size + cost > SuperblockEnlargeMaxSize || !affordable(cost)) {
+            continue;
+        }
+        SB_LOG(LogDetail, "Expanding the superblock at " << blocks.front()->getName() << " into " << target->getName() << "\n");
+        ore.emit([&]() {
+            return OptimizationRemark(DEBUG_TYPE, "BranchTargetExpanded", last->getTerminator())
+                   << "copied the superblock from " << ore::NV("Target", target->getName()) << " on ("
+                   << ore::NV("Instructions", cost) << " instructions) into the end of this superblock";
+        });
+        std::vector<std::vector<BasicBlock*>> copies = chainCopies(F, target_blocks, last, 1, ".expand", dtu);
+        blocks.insert(blocks.end(), copies.front().begin(), copies.front().end());
+        *curr_trace = Trace(blocks);
+        spend(cost);
+        ++NumExpandedTargets;
+        changed = true;
+    }
+
+    if (changed) {
+        timer.enter("loop info update");
+        li.releaseMemory();
+        li.analyze(dtu.getDomTree());
+    }
+    return changed;
+}
+
+// ------------------------------------------ superblock optimization ---------------------------------------------------
+// Within a superblock whose blocks after the first are each entered only from the block above,
+// everything earlier in the superblock dominates everything later, and values found along it
+// can replace the same values computed again further down, wherever those are used, side exits
+// included. Memory is only tracked as far as alias analysis can tell what an instruction touches.
+
+// what trace-local optimization removed from one function
+struct SuperblockOptReport {
+    unsigned loads = 0;     // loads replaced by a value already loaded or stored
+    unsigned stores = 0;    // stores of the value already in memory, or overwritten before anything reads them
+    unsigned exprs = 0;     // instructions that computed an expression already available
+    unsigned copies = 0;    // single-entry phis replaced by their incoming value
+
+    unsigned total() const { return loads + stores + exprs + copies; }
+};
+
+// true if I is an expression that can be replaced by an identical one computed earlier
+bool isCSECandidate(const Instruction &I) {
+    return !isa<PHINode>(I) && !isa<AllocaInst>(I) && !isa<CallBase>(I) && !I.isTerminator() && !I.isEHPad() &&
+           !I.getType()->isVoidTy() && !I.getType()->isTokenTy() && !I.mayReadOrWriteMemory() && !I.mayHaveSideEffects();
+}
+
+// the values available in memory and the stores not yet read, along one single-entry region
+class SuperblockMemory {
+public:
+    SuperblockMemory(AAResults &aa, const DataLayout &dl) : aa(aa), dl(dl) {}
+
+    // the value known to be in memory at ptr, as type, or nullptr
+    Value *available(Value *ptr, Type *type) const {
+        for (const Known &known : values) {
+            if (known.ptr == ptr && known.value->getType() == type) {
+                return known.value;
+            }
+        }
+        return nullptr;
+    }
+
+    void remember(Value *ptr, Value *value) {
+        if (values.size() == MaxTracked) {
+            values.erase(values.begin());
+        }
+        values.push_back({ptr, value});
+    }
+
+    // a store of the whole location store writes, with nothing reading it in between, makes store dead
+    StoreInst *overwrittenBy(StoreInst &store) const {
+        for (StoreInst *pending_store : pending) {
+            if (pending_store->getPointerOperand() == store.getPointerOperand() &&
+                pending_store->getValueOperand()->getType() == store.getValueOperand()->getType()) {
+                return pending_store;
+            }
+        }
+        return nullptr;
+    }
+
+    void addPending(StoreInst &store) {
+        if (pending.size() == MaxTracked) {
+            pending.erase(pending.begin());
+        }
+        pending.push_back(&store);
+    }
+    void removePending(StoreInst *store) { erase_value(pending, store); }
+
+    // forgets what I may overwrite, and the pending stores I may read
+    void clobber(Instruction &I) {
+        if (I.mayWriteToMemory()) {
+            erase_if(values, [&](const Known &known) {
+                return isModSet(aa.getModRefInfo(&I, location(known.ptr, known.value->getType())));
+            });
+        }
+        if (I.mayReadFromMemory()) {
+            erase_if(pending, [&](StoreInst *store) {
+                return isRefSet(aa.getModRefInfo(&I, MemoryLocation::get(store)));
+            });
+        }
+        if (I.mayThrow()) {
+            // unwinding makes every store visible, except to allocas that die with the frame
+            erase_if(pending, [](StoreInst *store) {
+                return !isa<AllocaInst>(getUnderlyingObject(store->getPointerOperand()));
+            });
+        }
+    }
+
+    // control may leave the superblock: every pending store is visible there
+    void sideExit() { pending.clear(); }
+
+    void clear() {
+        values.clear();
+        pending.clear();
+    }
+
+private:
+    // every clobber asks alias analysis about each tracked location, so long superblocks only
+    // remember the most recent ones
+    static constexpr size_t MaxTracked = 64;
+
+    struct Known {
+        Value *ptr;
+        Value *value;
+    };
+
+    MemoryLocation location(Value *ptr, Type *type) const {
+        return MemoryLocation(ptr, LocationSize::precise(dl.getTypeStoreSize(type)));
+    }
+
+    AAResults &aa;
+    const DataLayout &dl;
+    std::vector<Known> values;
+    std::vector<StoreInst*> pending;
+};
+
+// Runs load elimination, dead and redundant store elimination, common subexpression elimination
+// and copy propagation along every superblock of ctx. A superblock that tail duplication left with
+// a side entrance is optimized as separate regions, split at each block entered from elsewhere.
+// Returns true if F was changed.
+bool optimizeSuperblocks(Function &F, SuperblockContext &ctx, AAResults &aa) {
+    PhaseTimer timer(F.getName());
+    timer.enter("superblock optimization");
+    SuperblockOptReport report;
+    SuperblockMemory memory(aa, F.getParent()->getDataLayout());
+    DenseMap<hash_code, SmallVector<Instruction*, 1>> exprs;
+    auto hashExpr = [](Instruction &I) {
+        hash_code hash = hash_combine(I.getOpcode(), I.getType());
+        if (auto *cmp = dyn_cast<CmpInst>(&I)) {
+            hash = hash_combine(hash, cmp->getPredicate());
+        }
+        return hash_combine(hash, hash_combine_range(I.value_op_begin(), I.value_op_end()));
+    };
+    auto replace = [](Instruction &I, Value *value) {
+        SB_LOG(LogDetail, "Replacing " << I.getName() << " with " << value->getName() << "\n");
+        I.replaceAllUsesWith(value);
+        I.eraseFromParent();
+    };
+
+    for (const Trace &curr_trace : ctx.traces) {
+        for (unsigned i = 0; i < curr_trace.size(); i++) {
+            BasicBlock *bb = curr_trace.getBlock(i);
+            if (i == 0 || bb->getSinglePredecessor() != curr_trace.getBlock(i - 1)) {
+                exprs.clear();
+                memory.clear();
+            }
+            else {
+                // entered from one block only, so every phi is a copy of its incoming value
+                while (PHINode *phi = dyn_cast<PHINode>(&bb->front())) {
+                    replace(*phi, phi->getIncomingValue(0));
+                    report.copies++;
+                }
+            }
+
+            for (Instruction &I : make_early_inc_range(*bb)) {
+                LoadInst *load = dyn_cast<LoadInst>(&I);
+                StoreInst *store = dyn_cast<StoreInst>(&I);
+                if (load && load->isSimple()) {
+                    if (Value *value = memory.available(load->getPointerOperand(), load->getType())) {
+                        replace(*load, value);
+                        report.loads++;
+                        continue;
+                    }
+                    memory.clobber(*load);
+                    memory.remember(load->getPointerOperand(), load);
+                    continue;
+                }
+                if (store && store->isSimple()) {
+                    Value *ptr = store->getPointerOperand();
+                    Value *value = store->getValueOperand();
+                    if (memory.available(ptr, value->getType()) == value) {
+                        store->eraseFromParent();
+                        report.stores++;
+                        continue;
+                    }
+                    if (StoreInst *dead = memory.overwrittenBy(*store)) {
+                        memory.removePending(dead);
+                        dead->eraseFromParent();
+                        report.stores++;
+                    }
+                    memory.clobber(*store);
+                    memory.remember(ptr, value);
+                    memory.addPending(*store);
+                    continue;
+                }
+                if (isCSECandidate(I)) {
+                    SmallVector<Instruction*, 1> &same_hash = exprs[hashExpr(I)];
+                    auto found = llvm::find_if(same_hash, [&](Instruction *earlier) { return earlier->isIdenticalToWhenDefined(&I); });
+                    if (found != same_hash.end()) {
+                        // the earlier instruction now stands for both, so it keeps only the flags both had
+                        (*found)->andIRFlags(&I);
+                        replace(I, *found);
+                        report.exprs++;
+                        continue;
+                    }
+                    same_hash.push_back(&I);
+                    continue;
+                }
+                if (I.mayReadOrWriteMemory() || I.mayThrow()) {
+                    memory.clobber(I);
+                }
+            }
+
+            bool continues = i + 1 < curr_trace.size() && curr_trace.getBlock(i + 1)->getSinglePredecessor() == bb;
+            if (!continues || bb->getTerminator()->getNumSuccessors() > 1) {
+                memory.sideExit();
+            }
+        }
+    }
+
+    SB_LOG(LogSummary, F.getName() << ": removed " << report.loads << " loads, " << report.stores << " stores, "
+           << report.exprs << " common subexpressions and " << report.copies << " copies along superblocks\n");
+    NumEliminatedLoads += report.loads;
+    NumEliminatedStores += report.stores;
+    NumEliminatedExprs += report.exprs;
+    NumPropagatedCopies += report.copies;
+    return report.total() > 0;
+}
+
+// ------------------------------------------------ speculation ---------------------------------------------------------
+// Moves work along single-entry superblock regions: instructions are hoisted toward the entry, up
+// past the side exits above them, where executing them on the paths that leave early is safe, and
+// instructions whose value is only used off the superblock are sunk out of it into the exit that
+// needs them. Hoisting stops where the values the superblock keeps live would exceed
+// SuperblockSpeculateMaxPressure, as a stand-in for running out of registers.
+
+// the blocks of curr_trace split into maximal runs in which each block is entered only from the one above
+std::vector<std::vector<BasicBlock*>> superblockRegions(const Trace &curr_trace) {
+    std::vector<std::vector<BasicBlock*>> regions;
+    for (unsigned i = 0; i < curr_trace.size(); i++) {
+        BasicBlock *bb = curr_trace.getBlock(i);
+        if (i == 0 || bb->getSinglePredecessor() != curr_trace.getBlock(i - 1)) {
+            regions.emplace_back();
+        }
+        regions.back().push_back(bb);
+    }
+    return regions;
+}
+
+// what speculation did to one function
+struct SpeculationReport {
+    unsigned hoisted = 0;
+    unsigned sunk = 0;
+    unsigned compensationBlocks = 0;  // exit edges split to hold sunk instructions
+    unsigned limitedByPressure = 0;   // instructions that would have gone higher but for the pressure limit
+};
+
+// Sinks every instruction of region that only computes a value used off the region into the side
+// exit it is used on: the exit block itself if the region is its only predecessor, or a new block
+// on the exit edge. Users are visited before the instructions they use, so whole chains move.
+void sinkIntoExits(ArrayRef<BasicBlock*> region, DominatorTree &dt, LoopInfo &li, SpeculationReport &report) {
+    SmallPtrSet<BasicBlock*, 16> in_region(region.begin(), region.end());
+    DenseMap<std::pair<BasicBlock*, BasicBlock*>, BasicBlock*> compensation;
+    // the exit edge from the region through which use is reached, or a null edge if there is none
+    auto exitEdgeOf = [&](Use &U) -> std::pair<BasicBlock*, BasicBlock*> {
+        Instruction *user = cast<Instruction>(U.getUser());
+        BasicBlock *use_bb = user->getParent();
+        if (PHINode *phi = dyn_cast<PHINode>(user)) {
+            if (in_region.count(phi->getIncomingBlock(U)) && !in_region.count(use_bb)) {
+                return {phi->getIncomingBlock(U), use_bb};
+            }
+            use_bb = phi->getIncomingBlock(U);
+        }
+        if (in_region.count(use_bb) || !dt.getNode(use_bb)) {
+            return {nullptr, nullptr};
+        }
+        DomTreeNode *node = dt.getNode(use_bb);
+        while (node->getIDom() && !in_region.count(node->getIDom()->getBlock())) {
+            node = node->getIDom();
+        }
+        if (!node->getIDom() || node->getBlock()->getSinglePredecessor() != node->getIDom()->getBlock()) {
+            return {nullptr, nullptr};
+        }
+        return {node->getIDom()->getBlock(), node->getBlock()};
+    };
+
+    for (BasicBlock *bb : llvm::reverse(region)) {
+        for (Instruction &I : make_early_inc_range(llvm::reverse(*bb))) {
+            if (!isCSECandidate(I) || I.use_empty()) {
+                continue;
+            }
+            std::pair<BasicBlock*, BasicBlock*> edge{nullptr, nullptr};
+            bool phi_at_exit = false;
+            bool sinkable = llvm::all_of(I.uses(), [&](Use &U) {
+                std::pair<BasicBlock*, BasicBlock*> use_edge = exitEdgeOf(U);
+                if (!use_edge.first || (edge.first && use_edge != edge)) {
+                    return false;
                 }
-                else {
-                    branch.dir = !path;
+                edge = use_edge;
+                phi_at_exit |= isa<PHINode>(U.getUser()) && cast<Instruction>(U.getUser())->getParent() == edge.second;
+                return true;
+            });
+            // off a block whose only way out is the exit, the value is needed on every path anyway
+            BasicBlock *exit = edge.second;
+            if (!sinkable || edge.first->getSingleSuccessor() || exit->isEHPad() || isa<IndirectBrInst>(edge.first->getTerminator())) {
+                continue;
+            }
+            // a phi of the exit needs the value at the end of the edge, so it goes on the edge
+            BasicBlock *target = exit;
+            if (phi_at_exit || exit->getSinglePredecessor() != edge.first) {
+                BasicBlock *&split = compensation[edge];
+                if (!split) {
+                    split = SplitBlockPredecessors(exit, {edge.first}, ".exit", &dt, &li);
+                    if (!split) {
+                        continue;
+                    }
+                    report.compensationBlocks++;
                 }
+                target = split;
             }
+            SB_LOG(LogDetail, "Sinking " << I.getName() << " into " << target->getName() << "\n");
+            I.moveBefore(&*target->getFirstInsertionPt());
+            report.sunk++;
         }
     }
-    relbranch.push_back({BB, opc, pred, oppair, heur, path});
 }
 
-//returns true if the predicate is SLT
-bool isSLT(CmpInst *cmpInst) {
-    if (cmpInst->getPredicate() == CmpInst::ICMP_SLT) {
-        return true;
+// Hoists the instructions of region toward its entry, each to the earliest block that has its
+// operands and is at most SuperblockSpeculateDepth blocks up, as long as it is safe to execute
+// there, no store in between may write what it loads, and the values live across every block it
+// moves over stay under the pressure limit.
+void hoistInRegion(ArrayRef<BasicBlock*> region, DominatorTree &dt, AAResults &aa, SpeculationReport &report) {
+    unsigned n = region.size();
+    DenseMap<const BasicBlock*, unsigned> index;
+    DenseMap<const Instruction*, unsigned> def_index;
+    for (unsigned i = 0; i < n; i++) {
+        index[region[i]] = i;
+        for (Instruction &I : *region[i]) {
+            def_index[&I] = i;
+        }
     }
-    return false;
-}
 
-
-//Returns true if the icmp instruction is used by a branch instruction
-bool isUsedByBranch(Instruction &I) {
-    for (User *U : I.users()) {
-        //errs() << "User *U: " << *U << "\n";
-        auto userInstr = dyn_cast<Instruction>(U);
-        string userOpcode = userInstr -> getOpcodeName();
-        if (userOpcode == "br") {
-            return true;
+    // values defined in the region that are live out of each block, from the last block that uses
+    // them (to the end of the region if they are used on an exit)
+    std::vector<int> live_out(n + 1, 0);
+    for (unsigned d = 0; d < n; d++) {
+        for (Instruction &I : *region[d]) {
+            unsigned last_use = d;
+            for (Use &U : I.uses()) {
+                Instruction *user = cast<Instruction>(U.getUser());
+                BasicBlock *use_bb = user->getParent();
+                if (PHINode *phi = dyn_cast<PHINode>(user)) {
+                    use_bb = phi->getIncomingBlock(U);
+                }
+                auto found = index.find(use_bb);
+                last_use = std::max(last_use, found != index.end() ? found->second : n - 1);
+            }
+            live_out[d]++;
+            live_out[last_use]--;
         }
     }
-    return false;
-}
+    for (unsigned k = 1; k < n; k++) {
+        live_out[k] += live_out[k - 1];
+    }
 
-//Returns true if the constant variable for comparison is 0
-bool isZero(Instruction &I, Value &v) {
-        if (auto constInt = dyn_cast<ConstantInt>(&v)) {
-            if (constInt->isZero()) {
+    // true if an instruction of bb before end may write what load reads
+    auto clobbers = [&](BasicBlock *bb, Instruction *end, LoadInst *load) {
+        MemoryLocation loc = MemoryLocation::get(load);
+        for (Instruction &W : *bb) {
+            if (&W == end) {
+                break;
+            }
+            if (W.mayWriteToMemory() && isModSet(aa.getModRefInfo(&W, loc))) {
                 return true;
             }
         }
-    return false;
-}
-bool isFloatingPt(Instruction &I) {
-    if (FCmpInst *FCC = dyn_cast<FCmpInst>(&I)) {
-        if (FCC->getPredicate() == CmpInst::FCMP_OEQ) {
-            Value &op0 = *I.getOperand(0);
-            Value &op1 = *I.getOperand(1);
-            if (isa<ConstantFP>(&op0) && !(isa<ConstantFP>(&op1))) {
-                //errs() << "*I.getOperand(0)" << *I.getOperand(0) << "\n";
-                return true;
+        return false;
+    };
+
+    for (unsigned i = 1; i < n; i++) {
+        for (Instruction &I : make_early_inc_range(*region[i])) {
+            if (isa<PHINode>(I) || I.isTerminator() || isa<AllocaInst>(I) || I.getType()->isVoidTy() ||
+                !isSafeToSpeculativelyExecute(&I)) {
+                continue;
             }
-            else if (!(isa<ConstantFP>(&op0)) && isa<ConstantFP>(&op1)){
-                //errs() << "*I.getOperand(1); " << *I.getOperand(1) << "\n";
-                return true;
+            // the operands bound how high it can go
+            unsigned lowest = 0;
+            for (Value *op : I.operand_values()) {
+                if (Instruction *op_inst = dyn_cast<Instruction>(op)) {
+                    auto found = def_index.find(op_inst);
+                    if (found != def_index.end()) {
+                        lowest = std::max(lowest, found->second);
+                    }
+                }
             }
-        } 
+            LoadInst *load = dyn_cast<LoadInst>(&I);
+            if (lowest >= i || (load && clobbers(region[i], &I, load))) {
+                continue;
+            }
+            // farther up it would only lengthen live ranges, the latency is already hidden
+            if (i > SuperblockSpeculateDepth) {
+                lowest = std::max<unsigned>(lowest, i - SuperblockSpeculateDepth);
+            }
+            unsigned target = i;
+            bool pressure_limited = false;
+            while (target > lowest) {
+                unsigned above = target - 1;
+                if (load && target < i && clobbers(region[target], nullptr, load)) {
+                    break;
+                }
+                if (live_out[above] >= (int)SuperblockSpeculateMaxPressure) {
+                    pressure_limited = true;
+                    break;
+                }
+                if (!isSafeToSpeculativelyExecute(&I, region[above]->getTerminator(), &dt)) {
+                    break;
+                }
+                target = above;
+            }
+            if (pressure_limited) {
+                report.limitedByPressure++;
+            }
+            if (target == i) {
+                continue;
+            }
+            SB_LOG(LogDetail, "Hoisting " << I.getName() << " from " << region[i]->getName() << " to "
+                   << region[target]->getName() << "\n");
+            // facts that held where it was may not hold on the paths it now also runs on
+            I.dropUnknownNonDebugMetadata();
+            I.dropLocation();
+            I.moveBefore(region[target]->getTerminator());
+            def_index[&I] = target;
+            for (unsigned k = target; k < i; k++) {
+                live_out[k]++;
+            }
+            report.hoisted++;
+        }
     }
-    return false;
 }
-//Returns true if you want to take that branch (not neg comp)
-//Returns false if you don't want to take that branch (neg comp)
-bool isNegativeComparison (Instruction &I) {
-    if (isUsedByBranch(I) && isa<ICmpInst>(&I)) {
-        ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-        Value &SLT = *I.getOperand(1);
-        Value &SGT = *I.getOperand(0);
-        switch(pr){
-            case CmpInst::ICMP_SGT: return isZero(I, SGT);
-            case CmpInst::ICMP_SLT: return isZero(I, SLT);
-            //case CmpInst::ICMP_EQ: return isFloatingPt(I, )
+
+// Runs exit sinking and then hoisting on every superblock of ctx. dt and li are kept up to date
+// across the exit edges split for sunk instructions. Returns {instructions moved, CFG changed}.
+std::pair<bool, bool> speculateSuperblocks(Function &F, SuperblockContext &ctx, DominatorTree &dt, LoopInfo &li, AAResults &aa) {
+    PhaseTimer timer(F.getName());
+    timer.enter("speculation");
+    SpeculationReport report;
+    for (const Trace &curr_trace : ctx.traces) {
+        for (const std::vector<BasicBlock*> &region : superblockRegions(curr_trace)) {
+            sinkIntoExits(region, dt, li, report);
+            if (region.size() > 1) {
+                hoistInRegion(region, dt, aa, report);
+            }
         }
     }
-    return false;
+    SB_LOG(LogSummary, F.getName() << ": hoisted " << report.hoisted << " instructions (" << report.limitedByPressure
+           << " held back by register pressure), sank " << report.sunk << " into exits, " << report.compensationBlocks
+           << " of them new blocks\n");
+    NumSpeculatedInsts += report.hoisted;
+    NumSunkInsts += report.sunk;
+    NumCompensationBlocks += report.compensationBlocks;
+    return {report.hoisted + report.sunk > 0, report.compensationBlocks > 0};
 }
 
+// -------------------------------------------- superblock scheduling ---------------------------------------------------
+// Reorders the instructions of each single-entry superblock region with a list scheduler, so that
+// a backend that only schedules within basic blocks still sees the superblock's parallelism. The
+// dependence graph has an edge from every definition to its users, carrying the latency the
+// target reports for the definition; between memory accesses alias analysis cannot tell apart and
+// around anything that may not return; and around the side exits: an instruction issues before
+// the exit that ends its own block, and only moves up past an exit above it (at most
+// SuperblockSpeculateDepth of them) where it is safe to speculate. Long regions are scheduled in
+// windows of whole blocks, and a window keeps its order unless the new one is estimated shorter.
 
-void opcodeHeuristic(BasicBlock &BB) {
-    for (Instruction &I : BB) {
-        if (isUsedByBranch(I) && isa<ICmpInst>(&I)) {
-            if (isNegativeComparison(I)) {
-                string userOpcode = I.getOpcodeName();
-                ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                llvm::Value* passop1 = I.getOperand(0);
-                llvm::Value* passop2 = I.getOperand(1);
-                std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                errs() << "I Not taken" << I << "\n";
-                relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 3, false);
+// what scheduling did to one function
+struct ScheduleReport {
+    unsigned windows = 0;
+    unsigned reordered = 0;   // windows given a shorter order
+    unsigned speculated = 0;  // instructions moved up past a side exit
+    uint64_t cyclesBefore = 0;
+    uint64_t cyclesAfter = 0;
+};
+
+// the dependence graph of a window of a superblock region; edges only go from an instruction to
+// instructions after it, so the node order is a topological order
+class ScheduleGraph {
+public:
+    ScheduleGraph(ArrayRef<BasicBlock*> window, const TargetTransformInfo &tti, AAResults &aa, DominatorTree &dt) {
+        for (unsigned b = 0; b < window.size(); b++) {
+            for (Instruction &I : *window[b]) {
+                index[&I] = nodes.size();
+                nodes.push_back({&I, b, latencyOf(I, tti), 0, {}, {}});
             }
-            else {
-                string userOpcode = I.getOpcodeName();
-                ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                llvm::Value* passop1 = I.getOperand(0);
-                llvm::Value* passop2 = I.getOperand(1);
-                std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 3, true);
-            }
-        }
-        else if (FCmpInst *FCC = dyn_cast<FCmpInst>(&I)) {
-            if (isFloatingPt(I)) {
-                errs() << "I Not taken" << I << "\n";
-                
-                string userOpcode = I.getOpcodeName();
-                
-                FCmpInst *FCC = dyn_cast<FCmpInst>(&I);
-                llvm::CmpInst::Predicate pr=FCC->getSignedPredicate();
-                
-                llvm::Value* passop1 = I.getOperand(0);
-                
-                llvm::Value* passop2 = I.getOperand(1);
-                std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 3, false);
+            branches.push_back(nodes.size() - 1);
+        }
+        addDataEdges();
+        addControlEdges(window, dt);
+        addMemoryEdges(aa);
+        for (unsigned n = nodes.size(); n-- > 0;) {
+            Node &node = nodes[n];
+            node.height = node.latency;
+            for (const Edge &succ : node.succs) {
+                node.height = std::max(node.height, succ.latency + nodes[succ.node].height);
             }
-            else {
-                string userOpcode = I.getOpcodeName();
-                ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                llvm::Value* passop1 = I.getOperand(0);
-                llvm::Value* passop2 = I.getOperand(1);
-                std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 3, true);
-            }
-        }   
-        
+        }
     }
-}
 
-//Gets all preds based on the current basic block
-unordered_map<BasicBlock *, BasicBlock *> createPredsMap(BasicBlock &BB, llvm::LoopAnalysis::Result &li) {
-    std::unordered_map<BasicBlock *, BasicBlock *> PredsMap;
-    std::queue<BasicBlock *> PredsQueue;
-    for (Loop *L : li) {
-        BasicBlock *currBB = L->getHeader();
-        BasicBlock *latch = L->getLoopLatch();
-        while (currBB != latch) {
-            for (BasicBlock *Pred : predecessors(currBB)) {
-                PredsQueue.push(Pred);
-                PredsMap[Pred] = currBB;
+    // issue cycle an in-order machine of width reaches with the instructions in order, the
+    // estimated schedule length
+    unsigned length(ArrayRef<unsigned> order, unsigned width) const {
+        std::vector<unsigned> issued(nodes.size(), 0);
+        unsigned cycle = 0, used = 0, end = 0;
+        for (unsigned n : order) {
+            unsigned ready = cycle;
+            for (const Edge &pred : nodes[n].preds) {
+                ready = std::max(ready, issued[pred.node] + pred.latency);
             }
-            currBB = PredsQueue.front();
-            PredsQueue.pop();
+            if (ready > cycle) {
+                cycle = ready;
+                used = 0;
+            }
+            if (!isFree(n) && used++ == width) {
+                cycle++;
+                used = 1;
+            }
+            issued[n] = cycle;
+            end = std::max(end, cycle + nodes[n].latency);
         }
+        return end;
+    }
+
+    // the instructions in source order
+    std::vector<unsigned> sourceOrder() const {
+        std::vector<unsigned> order(nodes.size());
+        std::iota(order.begin(), order.end(), 0);
+        return order;
     }
-    return PredsMap;
-    
-}
 
-bool branchDirectionHeuristic(BasicBlock &BB, llvm::LoopAnalysis::Result &li) {
-    std::unordered_map<BasicBlock *, BasicBlock *> PredsMap = createPredsMap(BB, li);
-    for (Instruction &I : BB) {
-        string opcode = I.getOpcodeName();
-        if (opcode == "br") {
-            for (unsigned i = 0; i < I.getNumOperands(); i++) {
-                BasicBlock *opBB = dyn_cast<BasicBlock>(I.getOperand(i));
-                if (PredsMap.find(opBB) != PredsMap.end()) {
-                    ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                    llvm::CmpInst::Predicate pr;
-                    Value* passop1 = NULL;
-                    Value* passop2 = NULL;
-                    std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                    relatedBranchesHeuristic(&BB, opcode, pr, oppair, 5, true);
-                    return true;
+    // Issues up to width ready instructions per cycle, the longest path to the end of the window
+    // first and source order among equals, and returns the order they issued in.
+    std::vector<unsigned> listSchedule(unsigned width) const {
+        std::vector<unsigned> waiting(nodes.size()), earliest(nodes.size(), 0);
+        std::vector<unsigned> ready, order;
+        for (unsigned n = 0; n < nodes.size(); n++) {
+            waiting[n] = nodes[n].preds.size();
+            if (!waiting[n]) {
+                ready.push_back(n);
+            }
+        }
+        for (unsigned cycle = 0; order.size() < nodes.size(); cycle++) {
+            unsigned used = 0;
+            while (used < width) {
+                auto best = ready.end();
+                for (auto it = ready.begin(); it != ready.end(); ++it) {
+                    if (earliest[*it] <= cycle && (best == ready.end() || nodes[*it].height > nodes[*best].height ||
+                                                   (nodes[*it].height == nodes[*best].height && *it < *best))) {
+                        best = it;
+                    }
+                }
+                if (best == ready.end()) {
+                    break;
+                }
+                unsigned n = *best;
+                ready.erase(best);
+                order.push_back(n);
+                used += !isFree(n);
+                for (const Edge &succ : nodes[n].succs) {
+                    earliest[succ.node] = std::max(earliest[succ.node], cycle + succ.latency);
+                    if (!--waiting[succ.node]) {
+                        ready.push_back(succ.node);
+                    }
                 }
             }
         }
+        return order;
     }
-    return false;
-}
 
-// Finds store instruction
-// Gets the predecessor of that instruction
-// Gets the ICMP related to that predecessor's branch instruction
-// Gets the registers used in the ICMP
-// Checks if the registers were loaded with the same value as the store instruction
-// returns false if the same value was stored and loaded (The value was overwritten inside of the branch)
-// returns true if not.
-bool guardHeuristic(BasicBlock &BB) {
-    for (Instruction &Istore : BB) {
-        string opcode3 = Istore.getOpcodeName();
-        string opcode1 = Istore.getOpcodeName();
-        if (opcode1 == "store" && (Istore.getNumOperands() > 1)) {
-            Value &storeReg = *Istore.getOperand(1);
-            for (BasicBlock *Pred : predecessors(&BB)) {
-                for (Instruction &Icmp : *Pred) {
-                    Value &loadVal = *Icmp.getOperand(0);
-                    if (Instruction *loadInstr = dyn_cast<Instruction>(&loadVal)) {
-                        string opcode2 = loadInstr->getOpcodeName();
-                        if (isUsedByBranch(Icmp) && isa<ICmpInst>(&Icmp) && (opcode2 =="load") ) {
-                            for (unsigned i = 0; i < loadInstr->getNumOperands(); i++) {
-                                Value &loadReg = *loadInstr->getOperand(0);
-                                if (&loadReg == &storeReg) {
-                                    errs() << "loadReg" << loadReg << "\n";
-                                    errs() << "storeReg" << storeReg << "\n";
-                                    errs() << "Istore: " << Istore << "\n";
-                                    errs() << "loadVal: " << loadVal << "\n";
-                                    errs() << "Icmp: " << Icmp << "\n";
-                                    errs() << "Pred: " << *Pred << "\n";
-                                    if(opcode3 == "icmp" && isUsedByBranch(Istore)) {
-                                        string userOpcode = opcode3;
-                                        ICmpInst *ICC = dyn_cast<ICmpInst>(&Istore);
-                                        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                                        llvm::Value* passop1 = Istore.getOperand(0);
-                                        llvm::Value* passop2 = Istore.getOperand(1);
-                                        std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                                        relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 4, true);
-                                    }
-                                    
-                                    return true;
-                                }
-                                else {
-                                    if(opcode3 == "icmp" && isUsedByBranch(Istore)) {
-                                        string userOpcode = opcode3;
-                                        ICmpInst *ICC = dyn_cast<ICmpInst>(&Istore);
-                                        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                                        llvm::Value* passop1 = Istore.getOperand(0);
-                                        llvm::Value* passop2 = Istore.getOperand(1);
-                                        std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                                        relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 4, false);
-                                    }
-                                }
-                            }
-                        }
-                    }
+    // Moves the instructions into order: each one goes to the end of the block of the next exit
+    // after it, before the exit. Phis stay where they are. Returns the instructions moved up
+    // past a side exit.
+    unsigned apply(ArrayRef<unsigned> order) const {
+        unsigned speculated = 0;
+        std::vector<unsigned> pending;
+        for (unsigned n : order) {
+            if (!nodes[n].inst->isTerminator()) {
+                pending.push_back(n);
+                continue;
+            }
+            for (unsigned p : pending) {
+                Instruction *I = nodes[p].inst;
+                if (isa<PHINode>(I)) {
+                    continue;
                 }
+                if (nodes[p].block != nodes[n].block) {
+                    SB_LOG(LogDetail, "Scheduling " << I->getName() << " up into " << nodes[n].inst->getParent()->getName() << "\n");
+                    // facts that held where it was may not hold on the paths it now also runs on
+                    I->dropUnknownNonDebugMetadata();
+                    I->dropLocation();
+                    speculated++;
+                }
+                I->moveBefore(nodes[n].inst);
             }
+            pending.clear();
         }
+        return speculated;
     }
-    return false;
-}
 
-BasicBlock * nextBB(BasicBlock &BB, bool isFirstBranch) {
-    errs() << "BB: " << BB<< "\n";
-    for (Instruction &I: BB) {
-        string opcode = I.getOpcodeName();
-        if (opcode == "br") {
-            if (I.getNumOperands() == 1) {
-                BasicBlock *returnBB = dyn_cast<BasicBlock>((I.getOperand(0)));
-                BasicBlock &refBB = *returnBB;
-                errs() << "refBB0:" << refBB << "\n";
-                return returnBB;
-            }
-            else if (I.getNumOperands() > 1 && (isFirstBranch)) {
-                BasicBlock *returnBB = dyn_cast<BasicBlock>((I.getOperand(1)));
-                BasicBlock &refBB = *returnBB;
-                errs() << "refBB1:" << refBB << "\n";
-                return returnBB;
+private:
+    struct Edge {
+        unsigned node;
+        unsigned latency;
+    };
+    struct Node {
+        Instruction *inst;
+        unsigned block;    // index in the window of the block it is in
+        unsigned latency;  // cycles until users of its value may issue
+        unsigned height;   // cycles on the longest path from it to the end of the window
+        SmallVector<Edge, 4> preds;
+        SmallVector<Edge, 4> succs;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<unsigned> branches;  // the node of the terminator of each block
+    DenseMap<const Instruction*, unsigned> index;
+
+    static unsigned latencyOf(const Instruction &I, const TargetTransformInfo &tti) {
+        if (isa<PHINode>(I) || isa<DbgInfoIntrinsic>(I)) {
+            return 0;
+        }
+        Optional<InstructionCost::CostType> cost = tti.getInstructionCost(&I, TargetTransformInfo::TCK_Latency).getValue();
+        return cost ? std::max<unsigned>(1, std::min<InstructionCost::CostType>(*cost, 1000)) : 1;
+    }
+
+    // nodes that take no issue slot
+    bool isFree(unsigned n) const {
+        return isa<PHINode>(nodes[n].inst) || isa<DbgInfoIntrinsic>(nodes[n].inst);
+    }
+
+    void addEdge(unsigned from, unsigned to, unsigned latency) {
+        nodes[from].succs.push_back({to, latency});
+        nodes[to].preds.push_back({from, latency});
+    }
+
+    // from every definition to its users; a phi reads its operands at the end of the
+    // predecessor, so nothing in the window feeds it
+    void addDataEdges() {
+        for (unsigned n = 0; n < nodes.size(); n++) {
+            Instruction *I = nodes[n].inst;
+            if (isa<PHINode>(I)) {
+                continue;
             }
-            else {
-                BasicBlock *returnBB = dyn_cast<BasicBlock>((I.getOperand(2)));
-                BasicBlock &refBB = *returnBB;
-                errs() << "refBB2:" << refBB << "\n";
-                return returnBB;
+            SmallPtrSet<const Instruction*, 4> seen;
+            for (Value *op : I->operand_values()) {
+                Instruction *def = dyn_cast<Instruction>(op);
+                auto found = def ? index.find(def) : index.end();
+                if (found != index.end() && seen.insert(def).second) {
+                    addEdge(found->second, n, nodes[found->second].latency);
+                }
             }
         }
     }
-    return &BB;
-}
 
-bool isPointerEqual (Instruction &I) {
-    // string userOpcode = I.getOpcodeName();
-    // if (userOpcode == "br" && isa<ICmpInst>(&I)) {
-    
-    ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-    llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-    errs() << "in pointer equal " << pr << "\n";
-    Value &op2 = *I.getOperand(1);
-    switch(pr){
-        case CmpInst::ICMP_EQ: return true;
-        break;
-        case CmpInst::ICMP_NE: return false;
-        break;
+    // Every exit waits for the exit above it and for the instructions of its own block. An
+    // instruction waits for the exit just above the highest block it may be speculated into.
+    void addControlEdges(ArrayRef<BasicBlock*> window, DominatorTree &dt) {
+        for (unsigned n = 0; n < nodes.size(); n++) {
+            Instruction *I = nodes[n].inst;
+            unsigned b = nodes[n].block;
+            if (I->isTerminator()) {
+                if (b > 0) {
+                    addEdge(branches[b - 1], n, 0);
+                }
+                continue;
+            }
+            addEdge(n, branches[b], 0);
+            unsigned top = b;
+            LoadInst *load = dyn_cast<LoadInst>(I);
+            bool movable = !isa<PHINode>(I) && !isa<AllocaInst>(I) && !isa<DbgInfoIntrinsic>(I) && !I->getType()->isVoidTy() &&
+                           (!load || load->isSimple());
+            while (movable && top > 0 && b - top < SuperblockSpeculateDepth &&
+                   isSafeToSpeculativelyExecute(I, window[top - 1]->getTerminator(), &dt)) {
+                top--;
+            }
+            if (top > 0) {
+                addEdge(branches[top - 1], n, 0);
+            }
+        }
     }
-    return false;
-    // }
-}
-
-int pointerHeuristic(BasicBlock &BB) {
-    for (Instruction &I : BB) {
-        string userOpcode = I.getOpcodeName();
-        // errs() << "in pointer, instr is" << I << "and opcode" << userOpcode << "\n";
-        if (userOpcode == "icmp") {
-            errs() << "the instr is " << I << "\n";
-            // auto temp = dyn_cast<Instruction>(I.getOperand(0));
-            if (auto I1 = dyn_cast<Instruction>(I.getOperand(0))) {
-                if (isa<LoadInst>(I1)) {
-                    auto temp = dyn_cast<Instruction>(I1->getOperand(0));
-                    string tempOpcode = temp->getOpcodeName();
-                    if (tempOpcode == "getelementptr") {
-                        auto I2 = dyn_cast<Instruction>(I.getOperand(1));
-                        if (isa<LoadInst>(I2)) {
-                            auto temp2 = dyn_cast<Instruction>(I2->getOperand(0));
-                            string tempOpcode2 = temp2->getOpcodeName();
-                            if (tempOpcode2 == "getelementptr") {
-                                ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                                llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                                llvm::Value* passop1 = I.getOperand(0);
-                                llvm::Value* passop2 = I.getOperand(1);
-                                std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                                if (isPointerEqual(I)) {
-                                    errs() << "Second label is taken (corresponding to else path)" << "\n";
-                                    relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 1, false);
-                                    return 2;
-                                }
-                                else {
-                                    errs() << "First label is taken (corresponding to if path)" << "\n";
-                                    relatedBranchesHeuristic(&BB, userOpcode, pr, oppair, 1, true);
-                                    return 1;
-                                }
-                            }
-                        }
-                        
+
+    // Orders accesses that may touch the same memory, unless both only read, and keeps
+    // everything that touches memory or may trap on its side of anything that may not return
+    // or has side effects other than a store.
+    void addMemoryEdges(AAResults &aa) {
+        std::vector<unsigned> ordered;
+        for (unsigned n = 0; n < nodes.size(); n++) {
+            Instruction *I = nodes[n].inst;
+            if (!isa<PHINode>(I) && !isa<DbgInfoIntrinsic>(I) &&
+                (I->mayReadOrWriteMemory() || I->mayHaveSideEffects() || !isSafeToSpeculativelyExecute(I))) {
+                ordered.push_back(n);
+            }
+        }
+        auto isBarrier = [&](Instruction *I) {
+            return !isGuaranteedToTransferExecutionToSuccessor(I) || (I->mayHaveSideEffects() && !isa<StoreInst>(I));
+        };
+        for (unsigned i = 0; i < ordered.size(); i++) {
+            Instruction *first = nodes[ordered[i]].inst;
+            bool first_barrier = isBarrier(first);
+            for (unsigned j = i + 1; j < ordered.size(); j++) {
+                Instruction *second = nodes[ordered[j]].inst;
+                if (!first_barrier && !isBarrier(second)) {
+                    if (!first->mayReadOrWriteMemory() || !second->mayReadOrWriteMemory() ||
+                        (!first->mayWriteToMemory() && !second->mayWriteToMemory())) {
+                        continue;
                     }
-                    else if (I.getOperand(1) == nullptr) {
-                        ICmpInst *ICC = dyn_cast<ICmpInst>(&I);
-                        llvm::CmpInst::Predicate pr=ICC->getSignedPredicate();
-                        Value* passop1 = I.getOperand(0);
-                        Value* passop2 = NULL;
-                        std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                        switch(pr){
-                            case CmpInst::ICMP_EQ: errs() << "Second label is taken (corresponding to else path)" << "\n";
-                            relbranch.push_back({&BB, userOpcode, pr, oppair, 1, false});
-                            return 2;
-                            break;
-                            case CmpInst::ICMP_NE: errs() << "First label is taken (corresponding to if path)" << "\n";
-                            relbranch.push_back({&BB, userOpcode, pr, oppair, 1, true});
-                            return 1;
-                            break;
-                            default: errs() << "pointers have some other comparison operator" << "\n";
-                            return 0;
-                            break;
-                        }
+                    Optional<MemoryLocation> first_loc = MemoryLocation::getOrNone(first);
+                    Optional<MemoryLocation> second_loc = MemoryLocation::getOrNone(second);
+                    if (first_loc && second_loc && aa.isNoAlias(*first_loc, *second_loc)) {
+                        continue;
                     }
                 }
+                addEdge(ordered[i], ordered[j], 0);
             }
-            
-        }        
+        }
     }
-    errs() << "pointer heuristics are not used\n";
-    return 0;
+};
+
+// the blocks of region split into runs of at most SuperblockScheduleWindow instructions; a block
+// that is longer on its own is left out
+std::vector<ArrayRef<BasicBlock*>> scheduleWindows(ArrayRef<BasicBlock*> region) {
+    std::vector<ArrayRef<BasicBlock*>> windows;
+    unsigned start = 0, size = 0;
+    for (unsigned i = 0; i <= region.size(); i++) {
+        unsigned bb_size = i < region.size() ? region[i]->size() : 0;
+        if (i == region.size() || size + bb_size > SuperblockScheduleWindow) {
+            if (i > start) {
+                windows.push_back(region.slice(start, i - start));
+            }
+            start = i;
+            size = 0;
+            if (i < region.size() && bb_size > SuperblockScheduleWindow) {
+                start = i + 1;
+                continue;
+            }
+        }
+        size += bb_size;
+    }
+    return windows;
 }
 
-int loopHeuristic(BasicBlock &BB, llvm::LoopAnalysis::Result &li) {
-    std::vector<llvm::BasicBlock *> loopHeaders;
-    int flag = 0;
-    for (Loop *L : li) {
-        BasicBlock *header = L->getHeader();
-        errs() << "loop header is " << *(header->getTerminator()->getSuccessor(0)) << "\n";
-        loopHeaders.push_back(header->getTerminator()->getSuccessor(0));
-    }
-    for (Instruction &I : BB) {
-        string userOpcode = I.getOpcodeName();
-        if (userOpcode == "br") {
-            for (BasicBlock *Succ: successors(&BB)) {
-                auto headercheck = std::find(loopHeaders.begin(), loopHeaders.end(), Succ);
-                if (headercheck != loopHeaders.end()) {
-                    errs() << "This block is taken" << *Succ << "\n";
-                    flag = 1;
-                    llvm::CmpInst::Predicate pr;
-                    Value* passop1 = NULL;
-                    Value* passop2 = NULL;
-                    std::list<std::pair<llvm::Value*, llvm::Value*>> oppair = {std::make_pair(passop1, passop2)};
-                    relbranch.push_back({&BB, userOpcode, pr, oppair, 2, true});
-                    return 1;
-                    // store(instruction/bb, predicate, opcode, variables, heuristic), could be a global var, or local passed from main func
-                }
+// true if the instructions of window may be reordered at all
+bool canSchedule(ArrayRef<BasicBlock*> window) {
+    for (BasicBlock *bb : window) {
+        if (bb->isEHPad()) {
+            return false;
+        }
+        for (Instruction &I : *bb) {
+            CallInst *call = dyn_cast<CallInst>(&I);
+            if (I.getType()->isTokenTy() || (call && call->isMustTailCall())) {
+                return false;
             }
-            
         }
     }
-    if (flag == 0) {
-        errs() << "loop heuristics not applied" << "\n";
-        return 0;
+    return true;
+}
+
+// Schedules every superblock of ctx and reports the estimated schedule lengths before and after.
+// Returns true if any instruction moved.
+bool scheduleSuperblocks(Function &F, SuperblockContext &ctx, DominatorTree &dt, AAResults &aa, const TargetTransformInfo &tti,
+                         OptimizationRemarkEmitter &ore) {
+    PhaseTimer timer(F.getName());
+    timer.enter("scheduling");
+    unsigned width = std::max<unsigned>(1, SuperblockScheduleWidth);
+    ScheduleReport report;
+    for (const Trace &curr_trace : ctx.traces) {
+        if (curr_trace.size() < 2) {
+            continue;
+        }
+        for (const std::vector<BasicBlock*> &region : superblockRegions(curr_trace)) {
+            for (ArrayRef<BasicBlock*> window : scheduleWindows(region)) {
+                if (!canSchedule(window)) {
+                    continue;
+                }
+                ScheduleGraph graph(window, tti, aa, dt);
+                unsigned before = graph.length(graph.sourceOrder(), width);
+                std::vector<unsigned> order = graph.listSchedule(width);
+                unsigned after = graph.length(order, width);
+                report.windows++;
+                report.cyclesBefore += before;
+                if (after >= before) {
+                    report.cyclesAfter += before;
+                    continue;
+                }
+                SB_LOG(LogDetail, "Scheduling the superblock at " << window.front()->getName() << ": " << before << " cycles to "
+                       << after << "\n");
+                ore.emit([&]() {
+                    return OptimizationRemark(DEBUG_TYPE, "SuperblockScheduled", window.front()->getFirstNonPHI())
+                           << "scheduled a superblock in " << ore::NV("CyclesAfter", after) << " estimated cycles, down from "
+                           << ore::NV("CyclesBefore", before);
+                });
+                report.speculated += graph.apply(order);
+                report.cyclesAfter += after;
+                report.reordered++;
+            }
+        }
     }
-    return 0;
+    SB_LOG(LogSummary, F.getName() << ": scheduled " << report.windows << " superblock windows, reordered "
+           << report.reordered << ", estimated " << report.cyclesBefore << " cycles before and " << report.cyclesAfter
+           << " after, " << report.speculated << " instructions moved past side exits\n");
+    NumScheduledWindows += report.reordered;
+    NumScheduleSpeculated += report.speculated;
+    NumScheduleCyclesSaved += report.cyclesBefore - report.cyclesAfter;
+    return report.reordered > 0;
 }
 
-void runHeuristics(Function &F, llvm::LoopAnalysis::Result &li) {
+// ------------------------------------------- static branch weights --------------------------------------------------
+// Writes the combined static predictions as branch_weights on every conditional branch that
+// has none, so that later passes (block placement, inlining, loop passes) see them as if they
+// came from a profile. Returns true if any metadata was added.
+bool emitBranchWeights(Function &F, const BranchPredictionTable &table) {
+    const uint32_t scale = 1u << 20;
+    MDBuilder md_builder(F.getContext());
+    bool changed = false;
     for (BasicBlock &BB : F) {
-        errs() << "in BB " << BB << "\n";
-        pointerHeuristic(BB);
-        loopHeuristic(BB, li);
-        opcodeHeuristic(BB);
-        guardHeuristic(BB);
-        branchDirectionHeuristic(BB, li);
+        BranchInst *branch_inst = dyn_cast<BranchInst>(BB.getTerminator());
+        if (!branch_inst || !branch_inst->isConditional() || branch_inst->hasMetadata(LLVMContext::MD_prof)) {
+            continue;
+        }
+        const RelBranch *branch = table.lookup(&BB);
+        if (!branch) {
+            continue;
+        }
+        uint32_t taken = static_cast<uint32_t>(table.probability(*branch) * scale);
+        taken = std::min(std::max(taken, 1u), scale - 1);
+        branch_inst->setMetadata(LLVMContext::MD_prof, md_builder.createBranchWeights(taken, scale - taken));
+        ++NumBranchWeights;
+        changed = true;
+    }
+    return changed;
+}
 
+// ------------------------------------------------- block layout -------------------------------------------------------
+// Makes the likely successor of a conditional branch its false successor, the one a conditional
+// jump falls through to. Returns true if the branch was flipped.
+bool makeFallThrough(BranchInst *branch_inst, BasicBlock *likely) {
+    if (!branch_inst->isConditional() || branch_inst->getSuccessor(0) != likely || branch_inst->getSuccessor(1) == likely) {
+        return false;
     }
-    errs() << relbranch[0].heuristic << "\n";
-        
+    Value *cond = branch_inst->getCondition();
+    CmpInst *cmp = dyn_cast<CmpInst>(cond);
+    if (cmp && cmp->hasOneUse()) {
+        cmp->setPredicate(cmp->getInversePredicate());
+    }
+    else {
+        branch_inst->setCondition(BinaryOperator::CreateNot(cond, "", branch_inst));
+    }
+    // swaps the branch_weights along with the successors
+    branch_inst->swapSuccessors();
+    return true;
 }
 
-BasicBlock* getMostLikely(BasicBlock* curr) {
-    for (auto& branch : relbranch) {
-        if (curr == branch.bb) {
-            bool path = branch.dir;
-            if (path) {
-                return curr->getTerminator()->getSuccessor(0);
+// Lays the function out trace by trace, hottest first, so each superblock is contiguous and
+// falls through along its blocks. The entry trace stays first, and blocks outside any trace
+// (cloned tails) are placed after all traces. Returns true if a branch was flipped.
+bool layoutTraces(Function &F, SuperblockContext &ctx) {
+    std::vector<const Trace*> ordered;
+    for (const Trace &curr_trace : ctx.traces) {
+        ordered.push_back(&curr_trace);
+    }
+    BasicBlock *entry_block = &F.getEntryBlock();
+    std::stable_sort(ordered.begin(), ordered.end(), [&](const Trace *a, const Trace *b) {
+        if ((a->getEntryBasicBlock() == entry_block) != (b->getEntryBasicBlock() == entry_block)) {
+            return a->getEntryBasicBlock() == entry_block;
+        }
+        return ctx.frequencies.lookup(a->getEntryBasicBlock()) > ctx.frequencies.lookup(b->getEntryBasicBlock());
+    });
+
+    std::vector<BasicBlock*> layout;
+    SmallPtrSet<BasicBlock*, 32> placed;
+    bool changed = false;
+    for (const Trace *curr_trace : ordered) {
+        for (unsigned i = 0; i < curr_trace->size(); i++) {
+            BasicBlock *bb = curr_trace->getBlock(i);
+            if (!placed.insert(bb).second) {
+                continue;
             }
-            else {
-                return curr->getTerminator()->getSuccessor(1);
+            layout.push_back(bb);
+            if (i + 1 < curr_trace->size()) {
+                if (BranchInst *branch_inst = dyn_cast<BranchInst>(bb->getTerminator())) {
+                    if (makeFallThrough(branch_inst, curr_trace->getBlock(i + 1))) {
+                        ++NumFlippedBranches;
+                        changed = true;
+                    }
+                }
             }
         }
     }
-    errs() << "couldn't find a successor, something wrong\n";
-    exit(0);
+    for (BasicBlock &BB : F) {
+        if (!placed.count(&BB)) {
+            layout.push_back(&BB);
+        }
+    }
+    // the entry block has no predecessors, so it always heads its trace and stays in front
+    for (unsigned i = 1; i < layout.size(); i++) {
+        layout[i]->moveAfter(layout[i - 1]);
+    }
+    return changed;
 }
 
-double getAccuracy(Function &F, llvm::BranchProbabilityAnalysis::Result &bpi, llvm::LoopAnalysis::Result &li){
-    double stsum = 0;
-    double prsum = 0;
-    for (BasicBlock &BB : F) {
-        int count = 0;
-        for (BasicBlock *Succ: successors(&BB)) {
-            count += 1;
-        }
-        if (count > 1) {
-            BasicBlock* succ1 = BB.getTerminator()->getSuccessor(0);
-            BasicBlock* succ2 = BB.getTerminator()->getSuccessor(1);
-            BranchProbability prob1 = bpi.getEdgeProbability(&BB, succ1);
-            BranchProbability prob2 = bpi.getEdgeProbability(&BB, succ2);
-            uint64_t num1 = prob1.getNumerator();
-            uint64_t den1 = prob1.getDenominator();
-            double ratio1 = num1/ static_cast<double>(den1);
-            uint64_t num2 = prob2.getNumerator();
-            uint64_t den2 = prob2.getDenominator();
-            double ratio2 = num2/ static_cast<double>(den2);
-            if (ratio1 > ratio2) {
-                prsum += ratio1;
-            }
-            else {
-                prsum += ratio2;
-            }
-            BasicBlock* mostLikely = getMostLikely(&BB);
-            if (mostLikely == succ1) {
-                stsum += ratio1;
+// -------------------------------------------- hot/cold splitting ------------------------------------------------------
+// Outlines the cold code around the superblocks into separate functions placed in .text.unlikely,
+// so the hot traces pack densely. A block is cold if it is below SuperblockColdFreq of the
+// hottest block, is not in a trace headed by a hot block and is not a cloned tail (whose
+// frequency is unknown). Each cold region is a cold block together with the cold blocks it
+// dominates that are only entered from inside the region; the call CodeExtractor leaves at the
+// side exit reloads the region's inputs and outputs. Returns true if anything was outlined.
+bool splitColdBlocks(Function &F, SuperblockContext &ctx, DominatorTree &dt, OptimizationRemarkEmitter &ore) {
+    // regions smaller than this cost more in call overhead than they free in the hot code
+    const unsigned min_region_size = 3;
+
+    uint64_t max_freq = 0;
+    for (auto &entry : ctx.frequencies) {
+        max_freq = std::max(max_freq, entry.second);
+    }
+    double cold_freq = SuperblockColdFreq * max_freq;
+    SmallPtrSet<const BasicBlock*, 32> hot_blocks;
+    for (const Trace &curr_trace : ctx.traces) {
+        if (ctx.frequencies.lookup(curr_trace.getEntryBasicBlock()) >= cold_freq) {
+            hot_blocks.insert(curr_trace.begin(), curr_trace.end());
+        }
+    }
+    auto isCold = [&](BasicBlock *bb) {
+        auto freq = ctx.frequencies.find(bb);
+        return freq != ctx.frequencies.end() && freq->second < cold_freq && !hot_blocks.count(bb) &&
+               bb != &F.getEntryBlock() && !bb->isEHPad() && !isa<ReturnInst>(bb->getTerminator());
+    };
+
+    // collect all regions against one dominator tree, they are disjoint
+    SmallPtrSet<BasicBlock*, 32> assigned;
+    std::vector<SmallVector<BasicBlock*, 8>> regions;
+    for (DomTreeNode *node : depth_first(dt.getRootNode())) {
+        BasicBlock *root = node->getBlock();
+        if (assigned.count(root) || !isCold(root)) {
+            continue;
+        }
+        SmallVector<BasicBlock*, 8> region;
+        SmallPtrSet<BasicBlock*, 8> in_region;
+        region.push_back(root);
+        in_region.insert(root);
+        for (unsigned i = 0; i < region.size(); i++) {
+            for (DomTreeNode *child : *dt.getNode(region[i])) {
+                BasicBlock *bb = child->getBlock();
+                if (!isCold(bb) || assigned.count(bb)) {
+                    continue;
+                }
+                bool single_entry = llvm::all_of(predecessors(bb), [&](BasicBlock *pred) { return in_region.count(pred); });
+                if (single_entry) {
+                    region.push_back(bb);
+                    in_region.insert(bb);
+                }
             }
-            else{
-                stsum += ratio2;
+        }
+        assigned.insert(region.begin(), region.end());
+        unsigned size = 0;
+        for (BasicBlock *bb : region) {
+            size += bb->size();
+        }
+        if (size >= min_region_size) {
+            regions.push_back(region);
+        }
+    }
+
+    bool changed = false;
+    CodeExtractorAnalysisCache ceac(F);
+    for (auto &region : regions) {
+        CodeExtractor extractor(region, &dt, false, nullptr, nullptr, nullptr, false, false, "cold");
+        if (!extractor.isEligible()) {
+            continue;
+        }
+        Function *cold_function = extractor.extractCodeRegion(ceac);
+        if (!cold_function) {
+            continue;
+        }
+        cold_function->addFnAttr(Attribute::Cold);
+        cold_function->addFnAttr(Attribute::NoInline);
+        cold_function->setSectionPrefix("unlikely");
+        for (User *U : cold_function->users()) {
+            if (CallInst *call = dyn_cast<CallInst>(U)) {
+                call->setIsNoInline();
+                ore.emit([&]() {
+                    return OptimizationRemark(DEBUG_TYPE, "ColdOutlined", call)
+                           << "outlined " << ore::NV("Blocks", unsigned(region.size())) << " cold blocks into "
+                           << ore::NV("Callee", cold_function);
+                });
             }
         }
+        ++NumOutlinedRegions;
+        SB_LOG(LogSummary, "Outlined " << region.size() << " cold blocks into " << cold_function->getName() << "\n");
+        changed = true;
     }
-    return stsum/prsum;
+    return changed;
 }
 
-// --------------------------------------- the growTrace function -------------------------------------------------------
-std::list<BasicBlock*> visited;
-
-Trace growTrace(BasicBlock* current_block, DominatorTree& dom_tree){
-    //initialize trace with current_block
-    std::vector<BasicBlock*> trace_blocks;
-    trace_blocks.push_back(current_block);
+// one remark per trace of more than one block, at its entry; remarks are only emitted from
+// the thread that owns the function analysis manager, so not while traces are formed
+void emitTraceRemarks(const SuperblockContext &ctx, OptimizationRemarkEmitter &ore) {
+    for (const Trace &curr_trace : ctx.traces) {
+        if (curr_trace.size() < 2) {
+            continue;
+        }
+        ore.emit([&]() {
+            return OptimizationRemarkAnalysis(DEBUG_TYPE, "TraceFormed", curr_trace.getEntryBasicBlock()->getFirstNonPHI())
+                   << "formed a trace of " << ore::NV("Blocks", unsigned(curr_trace.size())) << " blocks ending in "
+                   << ore::NV("Exit", curr_trace.getBlock(curr_trace.size() - 1)->getName());
+        });
+    }
+}
 
-    //trace out the optimal path through loop according to hazard-avoidance and heuristics
-    while(1){
-        visited.push_back(current_block);
-        //check if current block contains a subroutine return or indirect jump
-        std::string opcodeName;
-        for(Instruction &I : *current_block){
-            opcodeName = I.getOpcodeName();
-            if(opcodeName == "ret"){
-                errs() << "Found a subroutine return!" << "\n";
-                Trace temp_trace = Trace(trace_blocks);
-                return temp_trace; // stop growing the trace
-            }
-            if(opcodeName == "indirectbr"){
-                errs() << "Found an indirect jump!" << "\n";
-                Trace temp_trace = Trace(trace_blocks);
-                return temp_trace; //stop growing trace
-            }
-        }
-        //get the likely block
-        BasicBlock* likely_block;
-        if(current_block->getSingleSuccessor()){
-            //then add the successor to the trace and make succ the new current block
-            likely_block = current_block->getSingleSuccessor();
-        }else{
-            //then call the heuristics function and pass the current block to it, receive the optimal successor in return
-            likely_block = getMostLikely(current_block); //needs to account for coming out of the loop -- loop heuristic should do that.
+// Runs every stage that rewrites F, in order, and returns the analyses still valid afterwards.
+// dt and li are kept up to date across the stages. Branch weights and layout leave the CFG
+// alone but change what the probability analyses (and the predictions) say about successors.
+// aa is only needed, and only passed, when the superblocks are optimized, speculated or scheduled, and tti only when
+// they are scheduled. can_outline is only set by the module pass, since a function pass may not add functions to the module.
+PreservedAnalyses transformFunction(Function &F, SuperblockContext &ctx, DuplicationBudget &budget, DominatorTree &dt, LoopInfo &li,
+                                    AAResults *aa, const TargetTransformInfo *tti, OptimizationRemarkEmitter &ore, bool can_outline) {
+    emitTraceRemarks(ctx, ore);
+    bool weights_changed = false;
+    bool cfg_changed = false;
+    bool successors_changed = false;
+    bool insts_changed = false;
+    PhaseTimer timer(F.getName());
+    // weights go on before tail duplication so the cloned branches carry them too
+    if (SuperblockEmitBranchWeights) {
+        timer.enter("branch weights");
+        weights_changed = emitBranchWeights(F, *ctx.table);
+        timer.stop();
+    }
+    {
+        // times its own phases
+        DomTreeUpdater dtu(dt, DomTreeUpdater::UpdateStrategy::Lazy);
+        cfg_changed = tailDuplicateTraces(F, ctx, budget, dtu, li, ore);
+        if (SuperblockEnlarge) {
+            cfg_changed |= enlargeSuperblocks(F, ctx, budget, dtu, li, ore);
         }
-        //check if likely_block has been visited, and if not, add it to the trace
-        if (std::find(visited.begin(), visited.end(), likely_block) == visited.end()){
-            // the likely_block has not been visited
-            if(dom_tree.dominates(likely_block, current_block)){
-                errs() << "The likely block dominates the current block! Stop! \n";
-                Trace temp_trace = Trace(trace_blocks);
-                return temp_trace;
-            }
-            
-            //then likely does not dominate current
-            errs() << "The likely block does not dominate the current block.\n";
-            trace_blocks.push_back(likely_block);
-            current_block = likely_block;
-        }else{
-            Trace temp_trace = Trace(trace_blocks);
-            return temp_trace;
+    }
+    if (aa && SuperblockOptimize) {
+        // times its own phase
+        insts_changed = optimizeSuperblocks(F, ctx, *aa);
+    }
+    if (aa && SuperblockSpeculate) {
+        std::pair<bool, bool> speculated = speculateSuperblocks(F, ctx, dt, li, *aa);
+        insts_changed |= speculated.first;
+        cfg_changed |= speculated.second;
+    }
+    if (aa && tti && SuperblockSchedule) {
+        // times its own phase
+        insts_changed |= scheduleSuperblocks(F, ctx, dt, *aa, *tti, ore);
+    }
+    if (SuperblockLayout) {
+        timer.enter("layout");
+        successors_changed = layoutTraces(F, ctx);
+    }
+    if (SuperblockSplitCold && can_outline) {
+        timer.enter("cold splitting");
+        if (splitColdBlocks(F, ctx, dt, ore)) {
+            return PreservedAnalyses::none();
         }
     }
+    if (!weights_changed && !cfg_changed && !successors_changed && !insts_changed) {
+        return PreservedAnalyses::all();
+    }
+    PreservedAnalyses PA;
+    PA.preserve<DominatorTreeAnalysis>();
+    PA.preserve<LoopAnalysis>();
+    if (!cfg_changed) {
+        PA.preserveSet<CFGAnalyses>();
+    }
+    if (!cfg_changed && !successors_changed && !insts_changed) {
+        // the heuristics do not read branch weights
+        PA.preserve<StaticBranchPredictionAnalysis>();
+    }
+    return PA;
 }
-        
+
 //%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%% start of pass %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 struct SuperblockFormationPass : public PassInfoMixin<SuperblockFormationPass> {
+    // shared by every function the pass runs on, for the module growth budget
+    DuplicationBudget budget;
 
     PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
-        // llvm::BlockFrequencyAnalysis::Result &bfi = FAM.getResult<BlockFrequencyAnalysis>(F);
+        StringMap<TimeRecord> times;
+        PhaseTimes = timingPhases() ? &times : nullptr;
+        llvm::BlockFrequencyAnalysis::Result &bfi = FAM.getResult<BlockFrequencyAnalysis>(F);
         llvm::BranchProbabilityAnalysis::Result &bpi = FAM.getResult<BranchProbabilityAnalysis>(F);
         llvm::LoopAnalysis::Result &li = FAM.getResult<LoopAnalysis>(F);
-        DominatorTree dt = DominatorTree(F);
-
-        runHeuristics(F, li);
-     
-        std::list<Trace> traces;
-        // ------------------------------------------ identifying loops ---------------------------------------------------------
-        // set up the lists and initialize them with top level loops in program
-        std::list<Loop*> bfs_loops;
-        std::list<Loop*> least_to_most_nested;
-        for (Loop* L : li) {
-            errs() << "top level loop: " << *L << "\n";
-            bfs_loops.push_back(L);
-            least_to_most_nested.push_back(L);
-        }
-
-        // now go through each loop in program in breadth-first order and add them to least_to_most_list
-        Loop* current_loop;
-        while (!bfs_loops.empty()){
-            // pop the top of the queue and set that to be current loop (initialize stack with all top level loops from LoopInfo)
-            current_loop = bfs_loops.front();
-            bfs_loops.pop_front();
-            // for each top level loop in the loop you are currently visiting, add the loop object to a stack.
-                // also add the loop to a list to be used later
-            for (Loop *SL : current_loop->getSubLoops()) {
-                errs() << "subloop: " << *SL << "\n";
-                bfs_loops.push_back(SL);
-                least_to_most_nested.push_back(SL);
-            }
-        }
+        DominatorTree &dt = FAM.getResult<DominatorTreeAnalysis>(F);
+        const BranchPredictionTable &table = FAM.getResult<StaticBranchPredictionAnalysis>(F);
 
-        //sanity check: print out loop depths to check they were ordered correctly. 
-        for (Loop* temp_loop : least_to_most_nested){
-            errs() << "Loop depth: " << temp_loop->getLoopDepth() << "\n";
-        }
+        OptimizationRemarkEmitter &ore = FAM.getResult<OptimizationRemarkEmitterAnalysis>(F);
 
-        // -------------------------------------- trace formation: loop bodies --------------------------------------------------
-        
-        //form traces with the loop bodies first
-        while(!least_to_most_nested.empty()){
-            //to iterate through the loops in most-nested order, access the back element of list and then pop it off.
-            Loop* current_loop = least_to_most_nested.back();
-            least_to_most_nested.pop_back();
-
-            //create bfs list of loop blocks, following same concept as above for bfs loops
-            std::list<BasicBlock*> bfs_blocks;  
-            std::list<BasicBlock*> loop_blocks;  
-            std::vector<BasicBlock*> blocks_vector = current_loop->getBlocksVector();
-            BasicBlock* header = current_loop->getHeader();
-            loop_blocks.push_back(header);
-            bfs_blocks.push_back(header);
-
-            errs() << "Starting new list of loop blocks! -------------- \n";
-        
-            BasicBlock* current_loop_block;
-            while(!loop_blocks.empty()){
-                current_loop_block = loop_blocks.front();
-                loop_blocks.pop_front();
-
-                for(BasicBlock* succ : successors(current_loop_block)){
-                    //if the successor is the header of the loop, we have taken backedge and need to stop
-                    if(succ == header){
-                        break;
-                    }
-                    //if the successor has already been added to bfs_blocks, don't add it again (happens when taking backedges that aren't from latch of current loop)
-                    if(std::find(bfs_blocks.begin(), bfs_blocks.end(), succ) != bfs_blocks.end()){
-                        break;
-                    }
-                    //if the successor is in the loop, add it to the bfs_loops list
-                    if(std::find(blocks_vector.begin(), blocks_vector.end(), succ) != blocks_vector.end()){
-                        loop_blocks.push_back(succ);
-                        bfs_blocks.push_back(succ);
-                    }
-                }
+        SuperblockContext ctx;
+        formTraces(F, dt, li, bpi, bfi, table, ctx);
+        AAResults *aa = SuperblockOptimize || SuperblockSpeculate || SuperblockSchedule ? &FAM.getResult<AAManager>(F) : nullptr;
+        const TargetTransformInfo *tti = SuperblockSchedule ? &FAM.getResult<TargetIRAnalysis>(F) : nullptr;
+        PreservedAnalyses PA = transformFunction(F, ctx, budget, dt, li, aa, tti, ore, false);
+        PhaseTimes = nullptr;
+        reportPhaseTimes(times, F.getName());
+        reportAccuracy(ctx.accuracy, F);
+        return PA;
+    }
+};
+
+// prints the static prediction of every conditional branch, as print<static-branch-prediction>
+struct StaticBranchPredictionPrinterPass : public PassInfoMixin<StaticBranchPredictionPrinterPass> {
+    raw_ostream &OS;
+
+    explicit StaticBranchPredictionPrinterPass(raw_ostream &OS) : OS(OS) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM) {
+        const BranchPredictionTable &table = FAM.getResult<StaticBranchPredictionAnalysis>(F);
+        OS << "Static branch predictions for function '" << F.getName() << "':\n";
+        for (BasicBlock &BB : F) {
+            BranchInst *branch_inst = dyn_cast<BranchInst>(BB.getTerminator());
+            if (!branch_inst || !branch_inst->isConditional()) {
+                continue;
             }
-            
-            // //sanity check: print out basic blocks to check they were ordered correctly. 
-            // for (BasicBlock* temp_block : bfs_blocks){
-            //     errs() << "Basic Block: " << *temp_block << "\n";
-            // }
-
-            // iterate through blocks in loop and forrm traces
-            for(BasicBlock* current_block : bfs_blocks){
-                if (std::find(visited.begin(), visited.end(), current_block) == visited.end()){
-                    // the current_block has not been visited
-                    Trace temp_trace = growTrace(current_block, dt);
-                    traces.push_back(temp_trace);
-                    errs() << "New trace --------------------------------------------- \n";
-                    for(BasicBlock* bb : temp_trace){
-                        errs() << "Trace bb: " << *bb << "\n";
-                    }
-                }
+            OS << "  " << BB.getName() << " -> " << branch_inst->getSuccessor(0)->getName();
+            if (const RelBranch *branch = table.lookup(&BB)) {
+                OS << format(" probability %.4f", table.probability(*branch)) << " heuristics " << table.heuristics(*branch) << "\n";
+            }
+            else {
+                OS << " not predicted\n";
             }
         }
-        // ---------------------------------------- trace formation: function blocks --------------------------------------------
-        BasicBlock& entry_block_addr = F.getEntryBlock();
-        BasicBlock* entry_block = &entry_block_addr;
-        std::list<BasicBlock*> function_blocks;
-        std::list<BasicBlock*> bfs_function_blocks;
-       
-        function_blocks.push_back(entry_block);
-        bfs_function_blocks.push_back(entry_block);
+        return PreservedAnalyses::all();
+    }
+};
 
-        while(!function_blocks.empty()){
-            BasicBlock* current_function_block = function_blocks.front();
-            function_blocks.pop_front();
+// ------------------------------------------- parallel module driver ---------------------------------------------------
+// Forms superblocks in every function of a module. Analyses are fetched from the FAM on the
+// calling thread, trace formation then runs for many functions at once on a thread pool, and
+// tail duplication is applied afterwards in module order. Each function's result only depends
+// on the function itself, so the output is the same for any number of threads.
+struct SuperblockModulePass : public PassInfoMixin<SuperblockModulePass> {
 
-            for(BasicBlock* succ : successors(current_function_block)){
-                //if the successor has already been added to bfs_blocks, don't add it again (happens when taking backedges that aren't from latch of current loop)
-                if(std::find(bfs_function_blocks.begin(), bfs_function_blocks.end(), succ) != bfs_function_blocks.end()){
-                    continue;
-                }else{
-                    function_blocks.push_back(succ);
-                    bfs_function_blocks.push_back(succ);
-                }
-            }
-        }
-        // //sanity check: print out basic blocks to check they were ordered correctly. 
-        // for (BasicBlock* temp_block : bfs_function_blocks){
-        //     errs() << "Basic Block: " << *temp_block << "\n";
-        // }
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+        FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
 
-        //now do trace formation for remaining function blocks
-        for(BasicBlock* current_block : bfs_function_blocks){
-            if (std::find(visited.begin(), visited.end(), current_block) == visited.end()){
-                // the current_block has not been visited
-                Trace temp_trace = growTrace(current_block, dt);
-                traces.push_back(temp_trace);
-                errs() << "New trace --------------------------------------------- \n";
-                for(BasicBlock* bb : temp_trace){
-                    errs() << "Trace bb: " << *bb << "\n";
-                }
+        struct FunctionWork {
+            Function *F;
+            DominatorTree *dt;
+            LoopInfo *li;
+            const BranchPredictionTable *table;
+            OptimizationRemarkEmitter *ore;
+            BranchProbabilityInfo *bpi;
+            BlockFrequencyInfo *bfi;
+            SuperblockContext ctx;
+        };
+        std::vector<FunctionWork> work;
+        for (Function &F : M) {
+            if (F.isDeclaration()) {
+                continue;
             }
+            DominatorTree &dt = FAM.getResult<DominatorTreeAnalysis>(F);
+            // number the tree now, so that dominates() queries from the workers never update it
+            dt.updateDFSNumbers();
+            work.push_back({&F, &dt, &FAM.getResult<LoopAnalysis>(F), nullptr, &FAM.getResult<OptimizationRemarkEmitterAnalysis>(F),
+                            &FAM.getResult<BranchProbabilityAnalysis>(F),
+                            &FAM.getResult<BlockFrequencyAnalysis>(F), SuperblockContext()});
+            // the heuristics are cheap next to trace formation, and the FAM may only be used from this thread
+            FunctionWork &w = work.back();
+            raw_string_ostream os(w.ctx.log);
+            LogStream = &os;
+            PhaseTimes = timingPhases() ? &w.ctx.times : nullptr;
+            w.table = &FAM.getResult<StaticBranchPredictionAnalysis>(F);
+            LogStream = nullptr;
+            PhaseTimes = nullptr;
         }
-        // ----------------------------------------------- tail duplication -----------------------------------------------------
-        //if there is a block in the trace other than the header that has multiple predecessors, we need to tail duplicate that block and all remaining blocks in trace below it
-        std::vector<Value*> usesToReplace;
-        std::vector<Instruction*> phisToReplaceWith;
-        ValueToValueMapTy VMap;
 
-        std::vector<std::vector<BasicBlock*>> list_of_bb_to_clone_lists;
-        std::vector<std::vector<BasicBlock*>> list_of_tail_lists;
-        for(Trace curr_trace : traces){
-            BasicBlock* first_in_trace = curr_trace.getEntryBasicBlock();
-            for(BasicBlock* curr_bb : curr_trace){
-                if(curr_bb->hasNPredecessorsOrMore(2) && curr_bb != first_in_trace){
-                    //if there is a block in the trace that has 2 or more predecessors, and it isn't the header, need to tail-duplicate
-            
-                    auto trace_size = curr_trace.size();
-                    auto curr_index = curr_trace.getBlockIndex(curr_bb);
-                    errs() << "The length of the trace is: " << trace_size << " and the index is "<< curr_index <<"\n";
-                    
-                    std::vector<BasicBlock*> bb_to_clone_list;
-                    std::vector<BasicBlock*> tail_list;
-                    std::list<BasicBlock*> cloned_blocks; //create a stack of cloned blocks in trace, pushing and popping from back
-                    for(int i=curr_index; i<trace_size; i++){ //for all of the blocks in the trace after the side entrance
-                        BasicBlock* bb_to_clone = curr_trace.getBlock(i); 
-                        
-                        //check if the BB has multiple predecessors but they are all in the trace
-                        bool needToClone = false;
-                        for(BasicBlock* parent : predecessors(bb_to_clone)){
-                            if(std::find(curr_trace.begin(), curr_trace.end(), parent) == curr_trace.end()){
-                                needToClone = true; //if there is a parent that is not in the trace, we need to clone
-                                errs() << "We need to clone: " << *bb_to_clone << "\n";
-                            }
-                        }
-                        if(needToClone){
-                            BasicBlock* cloned_bb = CloneBasicBlock(bb_to_clone, VMap);
-                            cloned_bb->insertInto(&F); //insert the cloned_bb into the function
-                            tail_list.push_back(cloned_bb);
-                            bb_to_clone_list.push_back(bb_to_clone);
-                            //errs() << "The cloned bb is: " << *cloned_bb <<"\n";
-                            
-                            //need to change the predecessors of the bb_to_clone and the cloned_bb
-                            for(BasicBlock* pred : predecessors(bb_to_clone)){ 
-                                //if the basic block only has one predecessor, then it is the second/third/etc in the trace
-                                if(!bb_to_clone->hasNPredecessorsOrMore(2)){ 
-                                    //need to connect cloned_bb as a successor of the previously cloned block
-                                    BasicBlock* latest_clone = cloned_blocks.back();
-                                    cloned_blocks.pop_back();
-                                    Instruction* terminator = latest_clone->getTerminator();
-                                    terminator->replaceSuccessorWith(bb_to_clone, cloned_bb);
-                                    cloned_blocks.push_back(cloned_bb);
-                                    errs() << "The cloned bb (only one pred) is now: " << *cloned_bb << "\n";
-                                }
-                                //if bb has more than one predecssor, one pred is in trace and should stay connected to bb_to_clone
-                                    //but other pred not in trace and should renove connection to curr_bb and instead connect to cloned_bb
-                                else if(std::find(curr_trace.begin(), curr_trace.end(), pred) == curr_trace.end()){
-                                    errs() << "We need to clone this multi pred block! " << *bb_to_clone << "\n";
-                                    Instruction* terminator = pred->getTerminator();
-                                    terminator->replaceSuccessorWith(bb_to_clone, cloned_bb);
-                                    cloned_blocks.push_back(cloned_bb);
-                                    errs() << "The cloned bb is now: " << *cloned_bb << "\n";
-                                }
-                            }
-                        }
-                        
+        {
+            ThreadPool pool(hardware_concurrency(SuperblockThreads));
+            // workers join the -time-trace profile of this thread, if there is one
+            bool tracing = timeTraceProfilerEnabled();
+            for (FunctionWork &w : work) {
+                pool.async([&w, tracing] {
+                    if (tracing) {
+                        timeTraceProfilerInitialize(500, "superblock");
                     }
-                    list_of_tail_lists.push_back(tail_list);
-                    list_of_bb_to_clone_lists.push_back(bb_to_clone_list);
-                }
-            }
-        }
-       
-
-        // -------------------------------------- fixing up uses in duplicated tail ---------------------------------------------
-        std::vector<User*> user_list;
-        std::vector<Value*> bb_inst_val_list;
-        std::vector<Value*> clone_inst_val_list;
-
-        for(int i=0; i<list_of_tail_lists.size(); i++){
-            errs() << "Start of new duplicated tail. \n";
-            std::vector<BasicBlock*> tail_list = list_of_tail_lists[i];
-            std::vector<BasicBlock*> bb_to_clone_list = list_of_bb_to_clone_lists[i];
-
-            for(int j=0; j<tail_list.size(); j++){
-                BasicBlock* cloned_bb = tail_list[j];
-                BasicBlock* bb_to_clone = bb_to_clone_list[j];
-                errs() << "BB: " << *cloned_bb << "\n";
-
-                for(Instruction& bb_inst : *bb_to_clone){
-                    if(!bb_inst.getType()->isVoidTy()){
-                        //if the instruction returns something, then must find the matching instruction in cloned_bb and fix any following uses
-                        for(Instruction& clone_inst : *cloned_bb){
-                            if(clone_inst.isIdenticalTo(&bb_inst)){ 
-                                errs() << clone_inst << " is identical to " << bb_inst << "\n";
-                                //then need to go through each block in duplicated tail and replaces uses of bb_inst with clone_inst
-                                Value* bb_inst_val = dyn_cast<Value>(&bb_inst);
-                                Value* clone_inst_val = dyn_cast<Value>(&clone_inst);
-
-                                
-                                for(auto user : bb_inst_val->users()){  // get all users (instructions) of the value
-                                    Instruction* temp_i = dyn_cast<Instruction>(user);
-                                    BasicBlock* temp_bb = temp_i->getParent();
-                                    errs() << "The user of the bb_inst_val is " << *temp_i << "\n";
-                                    //if the basicblock that uses the instruction is in the tail list, replace with the cloned inst value
-                                    if(std::find(tail_list.begin(), tail_list.end(), temp_bb) != tail_list.end()){
-                                        //I can't actually change the instruction here, because then future instructions are 
-                                        //no longer identical when they should be. Change only after this loop finishes. 
-                                        errs() << "replacing " << *clone_inst_val << " with " << *bb_inst_val << "\n";
-                                        user_list.push_back(user);
-                                        bb_inst_val_list.push_back(bb_inst_val);
-                                        clone_inst_val_list.push_back(clone_inst_val);
-                                    }
-
-                                }
-                            }
-                        }
+                    raw_string_ostream os(w.ctx.log);
+                    LogStream = &os;
+                    PhaseTimes = timingPhases() ? &w.ctx.times : nullptr;
+                    formTraces(*w.F, *w.dt, *w.li, *w.bpi, *w.bfi, *w.table, w.ctx);
+                    LogStream = nullptr;
+                    PhaseTimes = nullptr;
+                    if (tracing) {
+                        timeTraceProfilerFinishThread();
                     }
-                }
+                });
             }
+            pool.wait();
         }
-        //replace register uses in tail duplicated BBs with their cloned value counterparts
-        for(int i=0; i<user_list.size(); i++){
-            user_list[i]->replaceUsesOfWith(bb_inst_val_list[i], clone_inst_val_list[i]);
-        }
-
-        //print out basic blocks
-        // for (BasicBlock &BB : F){
-        //     errs() << "Basic Block: " << BB << "\n";
-        // }
-
-        //calculate accuracy compared to profile information
-        double acc = getAccuracy(F, bpi, li);
-        errs() << "Accuracy is: " << acc << "\n";
 
-    
-      // Your pass is modifying the source code. Figure out which analyses are preserved and only return those, not all.
-      return PreservedAnalyses::all();
+        bool changed = false;
+        DuplicationBudget budget;
+        DuplicationReport duplication;
+        for (FunctionWork &w : work) {
+            errs() << w.ctx.log;
+            PhaseTimes = timingPhases() ? &w.ctx.times : nullptr;
+            AAResults *aa = SuperblockOptimize || SuperblockSpeculate || SuperblockSchedule ? &FAM.getResult<AAManager>(*w.F) : nullptr;
+            const TargetTransformInfo *tti = SuperblockSchedule ? &FAM.getResult<TargetIRAnalysis>(*w.F) : nullptr;
+            PreservedAnalyses PA = transformFunction(*w.F, w.ctx, budget, *w.dt, *w.li, aa, tti, *w.ore, true);
+            PhaseTimes = nullptr;
+            reportPhaseTimes(w.ctx.times, w.F->getName());
+            reportAccuracy(w.ctx.accuracy, *w.F);
+            if (!PA.areAllPreserved()) {
+                FAM.invalidate(*w.F, PA);
+                changed = true;
+            }
+            duplication.add(w.ctx.duplication);
+        }
+        if (SuperblockVerbose >= LogSummary) {
+            duplication.print(errs(), M.getName());
+        }
+        if (!changed) {
+            return PreservedAnalyses::all();
+        }
+        // every changed function's analyses were invalidated above
+        PreservedAnalyses PA = PreservedAnalyses::none();
+        PA.preserveSet<AllAnalysesOn<Function>>();
+        PA.preserve<FunctionAnalysisManagerModuleProxy>();
+        return PA;
     }
 };
 }
@@ -846,6 +3443,11 @@ extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginIn
     return {
         LLVM_PLUGIN_API_VERSION, "SuperblockFormationPass", "v0.1",
         [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](FunctionAnalysisManager &FAM) {
+                    FAM.registerPass([] { return StaticBranchPredictionAnalysis(); });
+                }
+            );
             PB.registerPipelineParsingCallback(
                 [](StringRef Name, FunctionPassManager &FPM,
                 ArrayRef<PassBuilder::PipelineElement>) {
@@ -853,9 +3455,23 @@ extern "C" ::llvm::PassPluginLibraryInfo LLVM_ATTRIBUTE_WEAK llvmGetPassPluginIn
                         FPM.addPass(SuperblockFormationPass());
                         return true;
                     }
+                    if(Name == "print<static-branch-prediction>"){
+                        FPM.addPass(StaticBranchPredictionPrinterPass(errs()));
+                        return true;
+                    }
+                    return false;
+                }
+            );
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, ModulePassManager &MPM,
+                ArrayRef<PassBuilder::PipelineElement>) {
+                    if(Name == "superblock_module"){
+                        MPM.addPass(SuperblockModulePass());
+                        return true;
+                    }
                     return false;
                 }
             );
         }
     };
-}
\ No newline at end of file
+}
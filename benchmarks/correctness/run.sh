@@ -8,6 +8,8 @@ PATH2LIB="../../build/SuperblockFormationPass/SuperblockFormationPass.so"
 
 # ACTION NEEDED: Choose the correct pass when running.
 PASS=superblock_pass   
+# PASS=superblock_module   # forms superblocks in all functions at once, see -superblock-threads
+# Pass options such as -superblock-threads=N are only parsed when the plugin is also loaded with -load="${PATH2LIB}".
 
 BENCH=${1}.c
 
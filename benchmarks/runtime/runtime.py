@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""End-to-end runtime benchmark for the superblock formation pass.
+
+Does what the commented-out part of the run.sh scripts describes, for every C file in the
+benchmark directories. Each program is built twice at each optimization level: a baseline
+binary, and a superblock binary with the pass run on the same bitcode. Both binaries are
+run, and their output and exit code must match. Then the two are timed in alternating runs.
+The report gives the median time of each, the median of the per-run speedups
+(baseline / superblock) and its standard deviation.
+
+  python3 runtime.py --plugin build/SuperblockFormationPass/SuperblockFormationPass.so
+
+Exits non-zero if any build fails or any output differs from the baseline.
+"""
+import argparse
+import glob
+import os
+import statistics
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+BENCHMARKS = os.path.dirname(HERE)
+# directories under benchmarks/ that hold something other than C programs to time
+SKIP_DIRS = {'runtime', 'scaling'}
+
+# command line and stdin of programs that need input, relative to the work directory; the
+# inputs are written by workloads/gen_inputs.py
+WORKLOADS = {
+    'compress': (['compress.in'], None),
+    'anagram': (['words'], 'input.in'),
+}
+
+
+def check(cmd, **kwargs):
+    proc = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE, **kwargs)
+    if proc.returncode != 0:
+        raise RuntimeError('failed: %s\n%s' % (' '.join(cmd), proc.stderr.decode(errors='replace')))
+    return proc
+
+
+class Program:
+    def __init__(self, source, workdir):
+        self.source = source
+        self.name = os.path.splitext(os.path.basename(source))[0]
+        self.suite = os.path.basename(os.path.dirname(source))
+        self.workdir = workdir
+        self.args, self.stdin = WORKLOADS.get(self.name, ([], None))
+
+    def run(self, binary):
+        """Runs binary on the program's input, returns (stdout, exit code, wall seconds)."""
+        stdin = open(os.path.join(self.workdir, self.stdin), 'rb') if self.stdin else subprocess.DEVNULL
+        try:
+            start = time.perf_counter()
+            proc = subprocess.run([binary] + self.args, stdin=stdin, stdout=subprocess.PIPE,
+                                  stderr=subprocess.DEVNULL, cwd=self.workdir)
+            wall = time.perf_counter() - start
+        finally:
+            if self.stdin:
+                stdin.close()
+        return proc.stdout, proc.returncode, wall
+
+
+def build(prog, level, args):
+    """Builds the baseline and superblock binaries of prog at level, returns their paths."""
+    base = os.path.join(args.workdir, '%s.%s.%s' % (prog.suite, prog.name, level))
+    bc = base + '.bc'
+    cflags = ['-' + level]
+    if level == 'O0':
+        # like run.sh, keep the functions optimizable so the pass sees them
+        cflags += ['-Xclang', '-disable-O0-optnone']
+    check([args.clang, '-emit-llvm', '-c'] + cflags + [prog.source, '-o', bc])
+
+    pass_input = bc
+    if args.profile:
+        # the run.sh flow: instrument, run on the program's input, attach the profile
+        check([args.opt, '-passes=pgo-instr-gen,instrprof', bc, '-o', base + '.prof.bc'])
+        check([args.clang, '-fprofile-instr-generate', base + '.prof.bc', '-lm', '-o', base + '_prof'])
+        raw = base + '.profraw'
+        env = dict(os.environ, LLVM_PROFILE_FILE=raw)
+        stdin = open(os.path.join(prog.workdir, prog.stdin), 'rb') if prog.stdin else subprocess.DEVNULL
+        try:
+            subprocess.run([base + '_prof'] + prog.args, stdin=stdin, stdout=subprocess.DEVNULL,
+                           stderr=subprocess.DEVNULL, cwd=prog.workdir, env=env)
+        finally:
+            if prog.stdin:
+                stdin.close()
+        check([args.profdata, 'merge', '-o', base + '.profdata', raw])
+        pass_input = base + '.profdata.bc'
+        check([args.opt, '-passes=pgo-instr-use', '-pgo-test-profile-file=' + base + '.profdata',
+               bc, '-o', pass_input])
+
+    sb_bc = base + '.sb.bc'
+    load = ['-load=' + args.plugin, '-load-pass-plugin=' + args.plugin]
+    check([args.opt] + load + ['-passes=' + args.pass_name] + args.pass_args + [pass_input, '-o', sb_bc])
+
+    # both variants go through the same code generator at the same level, so the only
+    # difference between the binaries is the pass
+    binaries = []
+    for variant, variant_bc in (('base', pass_input), ('sb', sb_bc)):
+        obj = '%s.%s.o' % (base, variant)
+        check([args.llc, '-' + level, '-filetype=obj', '-relocation-model=pic', variant_bc, '-o', obj])
+        binary = '%s.%s' % (base, variant)
+        check([args.clang, obj, '-lm', '-o', binary])
+        binaries.append(binary)
+    return binaries
+
+
+def measure(prog, level, args):
+    """Returns a result row for prog at level, or a row with an error message."""
+    row = {'suite': prog.suite, 'program': prog.name, 'level': level}
+    try:
+        base_bin, sb_bin = build(prog, level, args)
+    except RuntimeError as e:
+        row['error'] = 'build ' + str(e)
+        return row
+
+    base_out, base_code, _ = prog.run(base_bin)
+    sb_out, sb_code, _ = prog.run(sb_bin)
+    if sb_code != base_code or sb_out != base_out:
+        row['error'] = 'output differs from the baseline (exit %d vs %d)' % (sb_code, base_code)
+        return row
+
+    # alternate the two binaries so drift in machine load hits both alike
+    base_times, sb_times = [], []
+    for _ in range(args.repeat):
+        base_times.append(prog.run(base_bin)[2])
+        sb_times.append(prog.run(sb_bin)[2])
+    speedups = [b / max(s, 1e-9) for b, s in zip(base_times, sb_times)]
+    row['base'] = statistics.median(base_times)
+    row['sb'] = statistics.median(sb_times)
+    row['speedup'] = statistics.median(speedups)
+    row['stdev'] = statistics.stdev(speedups) if len(speedups) > 1 else 0.0
+    return row
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--plugin', required=True, help='path to SuperblockFormationPass.so')
+    parser.add_argument('--clang', default='clang', help='clang matching the LLVM of the plugin')
+    parser.add_argument('--opt', default='opt', help='opt binary matching the plugin')
+    parser.add_argument('--llc', default='llc', help='llc binary matching the plugin')
+    parser.add_argument('--profdata', default='llvm-profdata', help='llvm-profdata, for --profile')
+    parser.add_argument('--pass', dest='pass_name', default='superblock_pass', help='superblock_pass or superblock_module')
+    parser.add_argument('--levels', default='O0,O2', help='comma separated optimization levels')
+    parser.add_argument('--repeat', type=int, default=5, help='timed runs of each binary')
+    parser.add_argument('--profile', action='store_true', help='run the pass on profile-annotated bitcode')
+    parser.add_argument('--filter', default='', help='only programs whose suite/name contains this')
+    parser.add_argument('--workdir', default='runtime_work', help='where inputs, bitcode and binaries go')
+    parser.add_argument('--csv', help='also write the results to this file')
+    parser.add_argument('pass_args', nargs='*', help='extra options for the pass, after --')
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    args.workdir = os.path.abspath(args.workdir)
+    check([sys.executable, os.path.join(BENCHMARKS, 'workloads', 'gen_inputs.py'), args.workdir])
+
+    sources = []
+    for source in sorted(glob.glob(os.path.join(BENCHMARKS, '*', '*.c'))):
+        suite = os.path.basename(os.path.dirname(source))
+        if suite not in SKIP_DIRS and args.filter in '%s/%s' % (suite, os.path.basename(source)):
+            sources.append(source)
+
+    print('%-12s %-18s %-5s %10s %10s %8s %7s' % ('suite', 'program', 'level', 'base s', 'sb s', 'speedup', 'stdev'))
+    rows = []
+    for source in sources:
+        prog = Program(source, args.workdir)
+        for level in args.levels.split(','):
+            row = measure(prog, level, args)
+            rows.append(row)
+            if 'error' in row:
+                print('%-12s %-18s %-5s FAILED: %s' % (row['suite'], row['program'], level, row['error']))
+            else:
+                print('%-12s %-18s %-5s %10.4f %10.4f %8.3f %7.3f' % (
+                    row['suite'], row['program'], level, row['base'], row['sb'], row['speedup'], row['stdev']))
+
+    good = [r for r in rows if 'error' not in r]
+    for level in args.levels.split(','):
+        speedups = [r['speedup'] for r in good if r['level'] == level]
+        if speedups:
+            print('%s: median speedup %.3f over %d programs' % (level, statistics.median(speedups), len(speedups)))
+
+    if args.csv:
+        with open(args.csv, 'w') as f:
+            f.write('suite,program,level,base_seconds,sb_seconds,speedup,speedup_stdev,error\n')
+            for r in rows:
+                if 'error' in r:
+                    f.write('%s,%s,%s,,,,,"%s"\n' % (r['suite'], r['program'], r['level'],
+                                                     r['error'].splitlines()[0].replace('"', "'")))
+                else:
+                    f.write('%s,%s,%s,%.5f,%.5f,%.4f,%.4f,\n' % (r['suite'], r['program'], r['level'],
+                                                                 r['base'], r['sb'], r['speedup'], r['stdev']))
+
+    failed = len(rows) - len(good)
+    if failed:
+        sys.exit('%d of %d builds failed or produced different output' % (failed, len(rows)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""Generates synthetic IR with large CFGs for the compile-time scaling benchmarks.
+
+Each shape is one function of about BLOCKS basic blocks:
+  loops    loop nests of depth --depth, with a diamond in every innermost body
+  diamonds one long chain of if-then-else diamonds whose joins carry a phi
+  switch   a single switch fanning out to one block per case
+  ifelse   a long if / else-if chain comparing the argument against constants
+
+  python3 gen_cfg.py loops 10000 > loops_10000.ll
+"""
+import argparse
+import sys
+
+
+def loops(blocks, depth):
+    out = ['@sink = global i32 0', '', 'define i32 @loops(i32 %n) {', 'entry:']
+    counter = [0]
+
+    def new_id():
+        counter[0] += 1
+        return counter[0]
+
+    def emit_loop(level, exit_label):
+        """Emits one loop (and the loops nested in it), returns its preheader label."""
+        k = new_id()
+        pre, header, latch, done = f'pre{k}', f'h{k}', f'latch{k}', f'x{k}'
+        out.append(f'{pre}:\n  br label %{header}')
+        out.append(f'{header}:\n  %i{k} = phi i32 [ 0, %{pre} ], [ %i{k}.next, %{latch} ]\n'
+                   f'  %c{k} = icmp slt i32 %i{k}, %n\n  br i1 %c{k}, label %b{k}, label %{done}')
+        if level < depth:
+            inner = emit_loop(level + 1, latch)
+            out.append(f'b{k}:\n  br label %{inner}')
+        else:
+            out.append(f'b{k}:\n  %a{k} = and i32 %i{k}, 1\n  %z{k} = icmp eq i32 %a{k}, 0\n'
+                       f'  br i1 %z{k}, label %t{k}, label %{latch}')
+            out.append(f't{k}:\n  store volatile i32 %i{k}, i32* @sink\n  br label %{latch}')
+        out.append(f'{latch}:\n  %i{k}.next = add i32 %i{k}, 1\n  br label %{header}')
+        out.append(f'{done}:\n  br label %{exit_label}')
+        return pre
+
+    # a nest of depth d has 5 blocks per loop and one more for the innermost diamond, and
+    # numbers its loops consecutively, so nest j starts at preheader pre{j * depth + 1}
+    nests = max(1, blocks // (5 * depth + 1))
+    out.append('  br label %pre1')
+    for j in range(nests):
+        emit_loop(1, f'pre{(j + 1) * depth + 1}' if j + 1 < nests else 'done')
+    out.append('done:\n  %r = load volatile i32, i32* @sink\n  ret i32 %r\n}')
+    return out
+
+
+def diamonds(blocks):
+    count = max(1, blocks // 3)
+    out = ['define i32 @diamonds(i32 %x) {', 'entry:', '  br label %d0']
+    value = '%x'
+    for i in range(count):
+        bit = 1 << (i % 31)
+        out.append(f'd{i}:\n  %m{i} = and i32 %x, {bit}\n  %c{i} = icmp eq i32 %m{i}, 0\n'
+                   f'  br i1 %c{i}, label %t{i}, label %j{i}')
+        out.append(f't{i}:\n  %a{i} = add i32 {value}, {i}\n  br label %j{i}')
+        nxt = f'd{i + 1}' if i + 1 < count else 'done'
+        out.append(f'j{i}:\n  %v{i} = phi i32 [ %a{i}, %t{i} ], [ {value}, %d{i} ]\n  br label %{nxt}')
+        value = f'%v{i}'
+    out.append(f'done:\n  ret i32 {value}\n}}')
+    return out
+
+
+def switch(blocks):
+    cases = max(1, blocks - 2)
+    out = ['define i32 @switch(i32 %x) {', 'entry:']
+    out.append('  switch i32 %x, label %done [\n' +
+               '\n'.join(f'    i32 {i}, label %s{i}' for i in range(cases)) + '\n  ]')
+    for i in range(cases):
+        out.append(f's{i}:\n  %a{i} = mul i32 %x, {i + 3}\n  br label %done')
+    incoming = ', '.join(f'[ %a{i}, %s{i} ]' for i in range(cases))
+    out.append(f'done:\n  %r = phi i32 [ 0, %entry ], {incoming}\n  ret i32 %r\n}}')
+    return out
+
+
+def ifelse(blocks):
+    tests = max(1, (blocks - 1) // 2)
+    out = ['define i32 @ifelse(i32 %x) {', 'entry:', '  br label %test0']
+    for i in range(tests):
+        nxt = f'test{i + 1}' if i + 1 < tests else 'done'
+        out.append(f'test{i}:\n  %c{i} = icmp eq i32 %x, {i}\n  br i1 %c{i}, label %case{i}, label %{nxt}')
+        out.append(f'case{i}:\n  %a{i} = add i32 %x, {i * 7}\n  br label %done')
+    incoming = ', '.join(f'[ %a{i}, %case{i} ]' for i in range(tests))
+    out.append(f'done:\n  %r = phi i32 [ -1, %test{tests - 1} ], {incoming}\n  ret i32 %r\n}}')
+    return out
+
+
+SHAPES = {
+    'loops': lambda blocks, args: loops(blocks, args.depth),
+    'diamonds': lambda blocks, args: diamonds(blocks),
+    'switch': lambda blocks, args: switch(blocks),
+    'ifelse': lambda blocks, args: ifelse(blocks),
+}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('shape', choices=sorted(SHAPES))
+    parser.add_argument('blocks', type=int, help='approximate number of basic blocks')
+    parser.add_argument('--depth', type=int, default=4, help='nesting depth of each loop nest (loops only)')
+    args = parser.parse_args()
+    sys.stdout.write('\n'.join(SHAPES[args.shape](args.blocks, args)) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""Compile-time scaling benchmark for the superblock formation pass.
+
+Generates every shape of gen_cfg.py at each size, runs opt over it once with the pass and once
+with a no-op pipeline, and prints the pass's wall time and opt's peak memory per size. The
+"exp" column is the growth exponent between consecutive sizes (log time / log size), so a
+linear phase stays near 1 and a quadratic hot spot shows up as 2.
+
+  python3 scaling.py --plugin build/SuperblockFormationPass/SuperblockFormationPass.so
+"""
+import argparse
+import math
+import os
+import subprocess
+import sys
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, HERE)
+import gen_cfg  # noqa: E402
+
+
+def run(cmd):
+    """Runs cmd, returns (wall seconds, peak resident MB) of that process alone."""
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    err = proc.stderr.read().decode(errors='replace')
+    proc.stderr.close()
+    if status != 0:
+        sys.exit('failed: %s\n%s' % (' '.join(cmd), err))
+    return wall, usage.ru_maxrss / 1024.0
+
+
+def best_of(cmd, repeat):
+    runs = [run(cmd) for _ in range(repeat)]
+    return min(r[0] for r in runs), max(r[1] for r in runs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--plugin', required=True, help='path to SuperblockFormationPass.so')
+    parser.add_argument('--opt', default='opt', help='opt binary matching the plugin')
+    parser.add_argument('--pass', dest='pass_name', default='superblock_pass', help='superblock_pass or superblock_module')
+    parser.add_argument('--shapes', default=','.join(sorted(gen_cfg.SHAPES)), help='comma separated shapes')
+    parser.add_argument('--sizes', default='1000,3000,10000,30000,100000', help='comma separated block counts')
+    parser.add_argument('--depth', type=int, default=4, help='nesting depth of the loop nests')
+    parser.add_argument('--repeat', type=int, default=1, help='runs per measurement, the fastest counts')
+    parser.add_argument('--workdir', default='scaling_inputs', help='where the generated IR is written')
+    parser.add_argument('--csv', help='also write the measurements to this file')
+    parser.add_argument('pass_args', nargs='*', help='extra options for the pass, after --')
+    args = parser.parse_args()
+
+    os.makedirs(args.workdir, exist_ok=True)
+    sizes = [int(s) for s in args.sizes.split(',')]
+    load = ['-load=' + args.plugin, '-load-pass-plugin=' + args.plugin]
+    rows = []
+    for shape in args.shapes.split(','):
+        print('\n%-9s %8s %9s %9s %9s %6s' % (shape, 'blocks', 'opt s', 'pass s', 'peak MB', 'exp'))
+        prev = None
+        results = []
+        for size in sizes:
+            path = os.path.join(args.workdir, '%s_%d.ll' % (shape, size))
+            with open(path, 'w') as f:
+                f.write('\n'.join(gen_cfg.SHAPES[shape](size, args)) + '\n')
+            # parsing and printing dominate small inputs, so time them separately and subtract
+            base, _ = best_of([args.opt, '-disable-output', '-passes=no-op-module', path], args.repeat)
+            total, peak = best_of([args.opt, '-disable-output'] + load + ['-passes=' + args.pass_name] +
+                                  args.pass_args + [path], args.repeat)
+            pass_time = max(total - base, 1e-6)
+            exp = ''
+            if prev:
+                exp = '%.2f' % (math.log(pass_time / prev[1]) / math.log(size / prev[0]))
+            prev = (size, pass_time)
+            results.append((size, total, pass_time, peak, exp))
+            rows.append((shape, size, total, pass_time, peak))
+            print('%-9s %8d %9.3f %9.3f %9.1f %6s' % ('', size, total, pass_time, peak, exp))
+        # the curve: pass time against blocks, scaled to the slowest size
+        slowest = max(r[2] for r in results)
+        for size, _, pass_time, _, _ in results:
+            print('  %8d |%s' % (size, '#' * max(1, int(round(50 * pass_time / slowest)))))
+
+    if args.csv:
+        with open(args.csv, 'w') as f:
+            f.write('shape,blocks,opt_seconds,pass_seconds,peak_mb\n')
+            for row in rows:
+                f.write('%s,%d,%.4f,%.4f,%.1f\n' % row)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Finds the anagrams of each phrase read from stdin, as one dictionary word or a pair of
+// words, in the style of the classic anagram benchmark. Words are reduced to letter counts
+// and looked up by a hash of their sorted letters.
+
+#define MAXWORD 32
+#define MAXPHRASE 64
+
+struct word {
+    char text[MAXWORD];
+    unsigned char count[26];
+    int length;
+    unsigned long key;    // hash of the sorted letters
+    struct word *next;    // bucket chain
+};
+
+#define BUCKETS 65536
+static struct word *buckets[BUCKETS];
+static struct word *words;
+static int nwords;
+
+static int letters(const char *s, unsigned char *count) {
+    int n = 0;
+    memset(count, 0, 26);
+    for (; *s; s++) {
+        if (isalpha((unsigned char)*s)) {
+            count[tolower((unsigned char)*s) - 'a']++;
+            n++;
+        }
+    }
+    return n;
+}
+
+static unsigned long key_of(const unsigned char *count) {
+    unsigned long h = 5381;
+    for (int i = 0; i < 26; i++) {
+        for (int j = 0; j < count[i]; j++) {
+            h = h * 33 + i;
+        }
+    }
+    return h;
+}
+
+// true if word fits inside the remaining letters, which are reduced by it
+static int take(unsigned char *remaining, const struct word *w) {
+    for (int i = 0; i < 26; i++) {
+        if (w->count[i] > remaining[i]) {
+            return 0;
+        }
+    }
+    for (int i = 0; i < 26; i++) {
+        remaining[i] -= w->count[i];
+    }
+    return 1;
+}
+
+static void load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    int capacity = 1024;
+    words = malloc(sizeof(struct word) * capacity);
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0] || strlen(line) >= MAXWORD) {
+            continue;
+        }
+        if (nwords == capacity) {
+            capacity *= 2;
+            words = realloc(words, sizeof(struct word) * capacity);
+        }
+        struct word *w = &words[nwords++];
+        strcpy(w->text, line);
+        w->length = letters(line, w->count);
+    }
+    fclose(f);
+    for (int i = 0; i < nwords; i++) {
+        struct word *w = &words[i];
+        w->key = key_of(w->count);
+        w->next = buckets[w->key % BUCKETS];
+        buckets[w->key % BUCKETS] = w;
+    }
+}
+
+static int same(const unsigned char *a, const unsigned char *b) {
+    return memcmp(a, b, 26) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s dictionary < phrases\n", argv[0]);
+        return 1;
+    }
+    load(argv[1]);
+    char phrase[256];
+    long total = 0;
+    while (fgets(phrase, sizeof(phrase), stdin)) {
+        phrase[strcspn(phrase, "\r\n")] = 0;
+        unsigned char count[26];
+        int n = letters(phrase, count);
+        if (n == 0 || n > MAXPHRASE) {
+            continue;
+        }
+        int singles = 0;
+        int pairs = 0;
+        // one word: look up the bucket of the phrase's letters
+        unsigned long key = key_of(count);
+        for (struct word *w = buckets[key % BUCKETS]; w; w = w->next) {
+            if (w->key == key && same(w->count, count)) {
+                singles++;
+            }
+        }
+        // two words: every word that fits, and the bucket of what it leaves over
+        for (int i = 0; i < nwords; i++) {
+            if (words[i].length >= n) {
+                continue;
+            }
+            unsigned char remaining[26];
+            memcpy(remaining, count, 26);
+            if (!take(remaining, &words[i])) {
+                continue;
+            }
+            unsigned long rest = key_of(remaining);
+            for (struct word *w = buckets[rest % BUCKETS]; w; w = w->next) {
+                // count each unordered pair once
+                if (w->key == rest && w >= &words[i] && same(w->count, remaining)) {
+                    pairs++;
+                }
+            }
+        }
+        printf("%s: %d words, %d pairs\n", phrase, singles, pairs);
+        total += singles + pairs;
+    }
+    printf("total %ld\n", total);
+    return 0;
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// LZW compression in the style of SPEC's compress: variable width codes from 9 to 16 bits,
+// a hashed string table, and a table reset when it fills up. Compresses the input file, expands
+// the codes again and checks that the round trip gives back the input.
+
+#define BITS 16
+#define HSIZE 69001            // 95% occupancy for 2^16 codes
+#define MAXCODE(n) ((1 << (n)) - 1)
+#define FIRST 257              // first free code, 256 is the reset code
+#define CLEAR 256
+
+static long htab[HSIZE];
+static unsigned short codetab[HSIZE];
+static unsigned short prefix[1 << BITS];
+static unsigned char suffix[1 << BITS];
+static unsigned char stack[1 << BITS];
+
+struct codes {
+    unsigned short *code;
+    unsigned char *width;
+    long count;
+};
+
+static void emit(struct codes *out, int code, int width) {
+    out->code[out->count] = (unsigned short)code;
+    out->width[out->count] = (unsigned char)width;
+    out->count++;
+}
+
+static void compress(const unsigned char *in, long n, struct codes *out) {
+    int n_bits = 9;
+    int maxcode = MAXCODE(n_bits);
+    int free_ent = FIRST;
+    memset(htab, -1, sizeof(htab));
+    if (n == 0) {
+        return;
+    }
+    int ent = in[0];
+    for (long i = 1; i < n; i++) {
+        int c = in[i];
+        long fcode = ((long)c << BITS) + ent;
+        int h = (c << 8) ^ ent;
+        int disp = h == 0 ? 1 : HSIZE - h;
+        int found = 0;
+        while (htab[h] >= 0) {
+            if (htab[h] == fcode) {
+                ent = codetab[h];
+                found = 1;
+                break;
+            }
+            h -= disp;
+            if (h < 0) {
+                h += HSIZE;
+            }
+        }
+        if (found) {
+            continue;
+        }
+        emit(out, ent, n_bits);
+        ent = c;
+        if (free_ent < (1 << BITS)) {
+            codetab[h] = (unsigned short)free_ent++;
+            htab[h] = fcode;
+            if (free_ent > maxcode + 1 && n_bits < BITS) {
+                n_bits++;
+                maxcode = MAXCODE(n_bits);
+            }
+        }
+        else {
+            // the table is full: start over, like compress does when the ratio drops
+            emit(out, CLEAR, n_bits);
+            memset(htab, -1, sizeof(htab));
+            free_ent = FIRST;
+            n_bits = 9;
+            maxcode = MAXCODE(n_bits);
+        }
+    }
+    emit(out, ent, n_bits);
+}
+
+static long expand(const struct codes *in, unsigned char *out) {
+    long n = 0;
+    int free_ent = FIRST;
+    int oldcode = -1;
+    int finchar = 0;
+    for (long i = 0; i < in->count; i++) {
+        int code = in->code[i];
+        if (code == CLEAR) {
+            free_ent = FIRST;
+            oldcode = -1;
+            continue;
+        }
+        if (oldcode < 0) {
+            finchar = code;
+            out[n++] = (unsigned char)code;
+            oldcode = code;
+            continue;
+        }
+        int incode = code;
+        int sp = 0;
+        if (code >= free_ent) {
+            // the KwKwK case: the code is the one about to be defined
+            stack[sp++] = (unsigned char)finchar;
+            code = oldcode;
+        }
+        while (code >= 256) {
+            stack[sp++] = suffix[code];
+            code = prefix[code];
+        }
+        finchar = code;
+        stack[sp++] = (unsigned char)finchar;
+        while (sp > 0) {
+            out[n++] = stack[--sp];
+        }
+        if (free_ent < (1 << BITS)) {
+            prefix[free_ent] = (unsigned short)oldcode;
+            suffix[free_ent] = (unsigned char)finchar;
+            free_ent++;
+        }
+        oldcode = incode;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s file\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *in = malloc(n + 1);
+    if (fread(in, 1, n, f) != (size_t)n) {
+        fprintf(stderr, "short read\n");
+        return 1;
+    }
+    fclose(f);
+
+    struct codes codes;
+    codes.code = malloc(sizeof(unsigned short) * (n + 2));
+    codes.width = malloc(n + 2);
+    unsigned char *out = malloc(n + 1);
+    long bits = 0;
+    unsigned long checksum = 0;
+    // several passes, so the run is long enough to time
+    for (int pass = 0; pass < 8; pass++) {
+        codes.count = 0;
+        compress(in, n, &codes);
+        long m = expand(&codes, out);
+        if (m != n || memcmp(in, out, n) != 0) {
+            printf("round trip failed at pass %d\n", pass);
+            return 1;
+        }
+        bits = 0;
+        for (long i = 0; i < codes.count; i++) {
+            bits += codes.width[i];
+            checksum = checksum * 31 + codes.code[i];
+        }
+    }
+    printf("%ld bytes in, %ld codes, %ld bytes out, ratio %.3f\n", n, codes.count, (bits + 7) / 8,
+           n ? (double)((bits + 7) / 8) / n : 0.0);
+    printf("checksum %lu\n", checksum);
+    free(in);
+    free(out);
+    free(codes.code);
+    free(codes.width);
+    return 0;
+}
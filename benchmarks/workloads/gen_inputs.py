@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+"""Writes the inputs of the compress and anagram workloads into a directory:
+
+  compress.in  text for compress, made of the dictionary words with some repetition
+  words        the dictionary for anagram, one word per line
+  input.in     phrases for anagram, one per line
+
+The inputs are generated from a fixed seed, so every run sees the same data.
+"""
+import argparse
+import os
+import random
+
+SYLLABLES = ['an', 'ar', 'bel', 'cor', 'da', 'en', 'er', 'fi', 'gan', 'ho', 'in', 'is', 'ka', 'la',
+             'lo', 'ma', 'mi', 'na', 'ne', 'or', 'pa', 're', 'ri', 'sa', 'se', 'sto', 'ta', 'ter',
+             'ti', 'to', 'un', 've', 'wa', 'yo']
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('outdir')
+    parser.add_argument('--words', type=int, default=20000)
+    parser.add_argument('--phrases', type=int, default=400)
+    parser.add_argument('--text-kb', type=int, default=1024)
+    args = parser.parse_args()
+    rng = random.Random(583)
+
+    words = set()
+    while len(words) < args.words:
+        words.add(''.join(rng.choice(SYLLABLES) for _ in range(rng.randint(1, 4))))
+    words = sorted(words)
+    os.makedirs(args.outdir, exist_ok=True)
+    with open(os.path.join(args.outdir, 'words'), 'w') as f:
+        f.write('\n'.join(words) + '\n')
+
+    # phrases made of two or three words, so that they have anagram pairs
+    with open(os.path.join(args.outdir, 'input.in'), 'w') as f:
+        for _ in range(args.phrases):
+            f.write(' '.join(rng.choice(words) for _ in range(rng.randint(2, 3))) + '\n')
+
+    # text with a skewed word distribution, which is what makes LZW compress
+    common = words[:500]
+    text = []
+    size = 0
+    while size < args.text_kb * 1024:
+        line = ' '.join(rng.choice(common) if rng.random() < 0.8 else rng.choice(words)
+                        for _ in range(rng.randint(6, 14)))
+        text.append(line)
+        size += len(line) + 1
+    with open(os.path.join(args.outdir, 'compress.in'), 'w') as f:
+        f.write('\n'.join(text) + '\n')
+
+
+if __name__ == '__main__':
+    main()